@@ -1,6 +1,10 @@
 #include <iostream>
 #include "line2Dup.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 using namespace cv;
 
@@ -59,11 +63,16 @@ void Feature::read(const FileNode &fn)
 {
     FileNodeIterator fni = fn.begin();
     fni >> x >> y >> label;
+    // Older files only kept the label, the center of its orientation bin is the best guess
+    if (fn.size() > 3)
+        fni >> theta;
+    else
+        theta = label * 22.5f;
 }
 
 void Feature::write(FileStorage &fs) const
 {
-    fs << "[:" << x << y << label << "]";
+    fs << "[:" << x << y << label << theta << "]";
 }
 
 void Template::read(const FileNode &fn)
@@ -100,6 +109,34 @@ void Template::write(FileStorage &fs) const
     fs << "]"; // features
 }
 
+void Template::linearize(int T)
+{
+    linear_features.resize(features.size());
+    for (size_t i = 0; i < features.size(); ++i)
+    {
+        const Feature &f = features[i];
+        LinearFeature &lf = linear_features[i];
+        lf.x = f.x;
+        lf.y = f.y;
+        lf.label = f.label;
+        // Floor division, so shifting a feature by a multiple of T only shifts lm_x, lm_y
+        lf.lm_x = f.x >= 0 ? f.x / T : -((T - 1 - f.x) / T);
+        lf.lm_y = f.y >= 0 ? f.y / T : -((T - 1 - f.y) / T);
+        lf.grid_index = (f.y - lf.lm_y * T) * T + (f.x - lf.lm_x * T);
+    }
+
+    std::stable_sort(linear_features.begin(), linear_features.end(),
+                     [](const LinearFeature &a, const LinearFeature &b) {
+                         if (a.label != b.label)
+                             return a.label < b.label;
+                         if (a.grid_index != b.grid_index)
+                             return a.grid_index < b.grid_index;
+                         if (a.lm_y != b.lm_y)
+                             return a.lm_y < b.lm_y;
+                         return a.lm_x < b.lm_x;
+                     });
+}
+
 static Rect cropTemplates(std::vector<Template> &templates)
 {
     int min_x = std::numeric_limits<int>::max();
@@ -203,198 +240,506 @@ bool ColorGradientPyramid::selectScatteredFeatures(const std::vector<Candidate>
 *                                                         Color gradient ColorGradient                                                                        *
 \****************************************************************************************/
 
-void hysteresisGradient(Mat &magnitude, Mat &quantized_angle,
-                        Mat &angle, float threshold)
+/**
+ * \brief One-hot label (1 << label) of a gradient, 8 orientations over 180 degrees.
+ *
+ * Same bins as rounding phase(dx, dy) in degrees to 16 buckets of 22.5 and keeping the low
+ * 3 bits, but without any atan2: the vector is folded into the upper half plane and the
+ * bin is found by comparing dy against dx scaled by the tangents of the bin edges,
+ * tan(11.25) ~ 1/5, tan(33.75) ~ 2/3, tan(56.25) ~ 3/2 and tan(78.75) ~ 5. These moves edges
+ * by less than 0.06 degree, below the error of fastAtan2 that phase() used. Products stay in
+ * int16 for |dx|, |dy| < 6553.
+ */
+static inline uchar quantizeGradient(int dx, int dy)
 {
-    // Quantize 360 degree range of orientations into 16 buckets
-    // Note that [0, 11.25), [348.75, 360) both get mapped in the end to label 0,
-    // for stability of horizontal and vertical features.
-    Mat_<unsigned char> quantized_unfiltered;
-    angle.convertTo(quantized_unfiltered, CV_8U, 16.0 / 360.0);
-
-    // Zero out top and bottom rows
-    /// @todo is this necessary, or even correct?
-    memset(quantized_unfiltered.ptr(), 0, quantized_unfiltered.cols);
-    memset(quantized_unfiltered.ptr(quantized_unfiltered.rows - 1), 0, quantized_unfiltered.cols);
-    // Zero out first and last columns
-    for (int r = 0; r < quantized_unfiltered.rows; ++r)
+    if (dy < 0)
     {
-        quantized_unfiltered(r, 0) = 0;
-        quantized_unfiltered(r, quantized_unfiltered.cols - 1) = 0;
+        dx = -dx;
+        dy = -dy;
     }
+    int adx = std::abs(dx);
+    // Number of bin edges passed from the horizontal, 0 to 4
+    int k = (5 * dy > adx) + (3 * dy > 2 * adx) + (2 * dy > 3 * adx) + (dy > 5 * adx);
+    // Left half plane counts down from 180 degrees
+    int label = dx < 0 ? (8 - k) & 7 : k;
+    return uchar(1 << label);
+}
 
-    // Mask 16 buckets into 8 quantized orientations
-    for (int r = 1; r < angle.rows - 1; ++r)
+/**
+ * \brief One-hot orientation labels of int16 derivatives, see quantizeGradient().
+ */
+static void quantizeGradients(const Mat &dx, const Mat &dy, Mat &labels)
+{
+    labels.create(dx.size(), CV_8U);
+    std::vector<int16_t> row(dx.cols);
+
+    const mipp::Reg<int16_t> zero(int16_t(0));
+    const mipp::Reg<int16_t> two(int16_t(2)), three(int16_t(3)), five(int16_t(5));
+    // One-hot labels for k = 1..4 edges passed, right and left half plane
+    const mipp::Reg<int16_t> one_hot_0(int16_t(1));
+    const mipp::Reg<int16_t> right_1(int16_t(2)), right_2(int16_t(4)), right_3(int16_t(8)), one_hot_4(int16_t(16));
+    const mipp::Reg<int16_t> left_1(int16_t(128)), left_2(int16_t(64)), left_3(int16_t(32));
+
+    for (int r = 0; r < dx.rows; ++r)
     {
-        uchar *quant_r = quantized_unfiltered.ptr<uchar>(r);
-        for (int c = 1; c < angle.cols - 1; ++c)
+        const int16_t *dx_r = dx.ptr<int16_t>(r);
+        const int16_t *dy_r = dy.ptr<int16_t>(r);
+        uchar *labels_r = labels.ptr<uchar>(r);
+
+        int c = 0;
+        for (; c <= dx.cols - mipp::N<int16_t>(); c += mipp::N<int16_t>())
         {
-            quant_r[c] &= 7;
+            mipp::Reg<int16_t> x((int16_t *)dx_r + c);
+            mipp::Reg<int16_t> y((int16_t *)dy_r + c);
+
+            // Fold into the upper half plane
+            mipp::Msk<mipp::N<int16_t>()> lower = y < zero;
+            x = mipp::blend(zero - x, x, lower);
+            y = mipp::abs(y);
+            mipp::Reg<int16_t> adx = mipp::abs(x);
+            mipp::Msk<mipp::N<int16_t>()> left = x < zero;
+
+            // Bin edges are nested, each passed one overrides the previous label
+            mipp::Reg<int16_t> one_hot = one_hot_0;
+            one_hot = mipp::blend(mipp::blend(left_1, right_1, left), one_hot, y * five > adx);
+            one_hot = mipp::blend(mipp::blend(left_2, right_2, left), one_hot, y * three > adx * two);
+            one_hot = mipp::blend(mipp::blend(left_3, right_3, left), one_hot, y * two > adx * three);
+            one_hot = mipp::blend(one_hot_4, one_hot, y > adx * five);
+            one_hot.store(row.data() + c);
         }
+        for (int i = 0; i < c; ++i)
+            labels_r[i] = uchar(row[i]);
+
+        for (; c < dx.cols; ++c)
+            labels_r[c] = quantizeGradient(dx_r[c], dy_r[c]);
+    }
+}
+
+/**
+ * \brief Sum of three one-bit-per-lane values, as a sum bit and a carry bit.
+ */
+template <typename V>
+static inline void fullAdder(const V &a, const V &b, const V &c, V &sum, V &carry)
+{
+    V ab = a ^ b;
+    sum = ab ^ c;
+    carry = (a & b) | (c & ab);
+}
+/**
+ * \brief Label with at least 5 of the 9 votes of a 3x3 patch, computed on one-hot bytes.
+ *
+ * Each byte holds 1 << label, so its 8 bits are independent lanes and adding up the 9 bytes
+ * with bitwise full adders counts the votes of all 8 labels at once. At most one label can
+ * reach 5, so the result is 1 << label, or 0 without a majority.
+ */
+template <typename V>
+static inline V majorityVote3x3(const V &a0, const V &a1, const V &a2,
+                                const V &a3, const V &a4, const V &a5,
+                                const V &a6, const V &a7, const V &a8)
+{
+    V s0, s1, s2, c0, c1, c2;
+    fullAdder(a0, a1, a2, s0, c0);
+    fullAdder(a3, a4, a5, s1, c1);
+    fullAdder(a6, a7, a8, s2, c2);
+
+    // Count bits, weights 1, 2, 4 and 8
+    V bit0, twos, t, fours;
+    fullAdder(s0, s1, s2, bit0, twos);
+    fullAdder(c0, c1, c2, t, fours);
+    V bit1 = t ^ twos;
+    V carry = t & twos;
+    V bit2 = fours ^ carry;
+    V bit3 = fours & carry;
+
+    // votes >= 5
+    return bit3 | (bit2 & (bit1 | bit0));
+}
+
+/**
+ * \brief Majority vote over columns [1, width - 1) of three consecutive one-hot rows.
+ */
+static void majorityVoteRow(const uchar *up, const uchar *mid, const uchar *down, uchar *dst, int width)
+{
+    // Bitwise work does not care about lane type, int32_t has the full set of operations
+    const int bytes = mipp::N<int32_t>() * 4;
+
+    int c = 1;
+    for (; c + bytes < width; c += bytes)
+    {
+        mipp::Reg<int32_t> v = majorityVote3x3(
+            mipp::Reg<int32_t>((const int32_t *)(up + c - 1)),
+            mipp::Reg<int32_t>((const int32_t *)(up + c)),
+            mipp::Reg<int32_t>((const int32_t *)(up + c + 1)),
+            mipp::Reg<int32_t>((const int32_t *)(mid + c - 1)),
+            mipp::Reg<int32_t>((const int32_t *)(mid + c)),
+            mipp::Reg<int32_t>((const int32_t *)(mid + c + 1)),
+            mipp::Reg<int32_t>((const int32_t *)(down + c - 1)),
+            mipp::Reg<int32_t>((const int32_t *)(down + c)),
+            mipp::Reg<int32_t>((const int32_t *)(down + c + 1)));
+        v.store((int32_t *)(dst + c));
+    }
+
+    for (; c < width - 1; ++c)
+    {
+        dst[c] = majorityVote3x3<uchar>(up[c - 1], up[c], up[c + 1],
+                                        mid[c - 1], mid[c], mid[c + 1],
+                                        down[c - 1], down[c], down[c + 1]);
+    }
+}
+
+void hysteresisGradient(Mat &magnitude, Mat &quantized_angle,
+                        Mat &quantized_unfiltered, int threshold)
+{
+    // Labels come one-hot as 1 << label, see quantizeGradients().
+    // Top and bottom rows, first and last columns are label 0.
+    /// @todo is this necessary, or even correct?
+    memset(quantized_unfiltered.ptr(), 1, quantized_unfiltered.cols);
+    memset(quantized_unfiltered.ptr(quantized_unfiltered.rows - 1), 1, quantized_unfiltered.cols);
+    for (int r = 0; r < quantized_unfiltered.rows; ++r)
+    {
+        quantized_unfiltered.at<uchar>(r, 0) = 1;
+        quantized_unfiltered.at<uchar>(r, quantized_unfiltered.cols - 1) = 1;
     }
 
     // Filter the raw quantized image. Only accept pixels where the magnitude is above some
     // threshold, and there is local agreement on the quantization.
-    quantized_angle = Mat::zeros(angle.size(), CV_8U);
-    for (int r = 1; r < angle.rows - 1; ++r)
+    quantized_angle = Mat::zeros(quantized_unfiltered.size(), CV_8U);
+    std::vector<uchar> votes(quantized_unfiltered.cols);
+    for (int r = 1; r < quantized_unfiltered.rows - 1; ++r)
     {
-        float *mag_r = magnitude.ptr<float>(r);
+        majorityVoteRow(quantized_unfiltered.ptr(r - 1), quantized_unfiltered.ptr(r),
+                        quantized_unfiltered.ptr(r + 1), votes.data(), quantized_unfiltered.cols);
+
+        const int *mag_r = magnitude.ptr<int>(r);
+        uchar *quant_r = quantized_angle.ptr<uchar>(r);
+        for (int c = 1; c < quantized_unfiltered.cols - 1; ++c)
+            quant_r[c] = mag_r[c] > threshold ? votes[c] : uchar(0);
+    }
+}
+
+/**
+ * \brief Separable smoothing + derivative kernels, applied in fixed point.
+ *
+ * smooth and diff are the correlation taps of the 1D smoothing and derivative filters,
+ * the 2D derivatives are diff x smooth (dx) and smooth x diff (dy), rounded and shifted
+ * down by shift bits at the end.
+ */
+struct DerivativeKernel
+{
+    int radius;
+    int shift;
+    int smooth[9];
+    int diff[9];
+};
 
-        for (int c = 1; c < angle.cols - 1; ++c)
+// 7x7 Gaussian (the fixed sigma = 0 kernel {2, 7, 14, 18, 14, 7, 2} / 64) folded into
+// the 3x3 Sobel, scale 64 * 4 per axis
+static const DerivativeKernel BLURRED_SOBEL = {4, 12,
+                                               {2, 11, 30, 53, 64, 53, 30, 11, 2},
+                                               {-2, -7, -12, -11, 0, 11, 12, 7, 2}};
+// Plain 3x3 Sobel, for sources that pyrDown already smoothed
+static const DerivativeKernel SOBEL = {1, 0, {1, 2, 1}, {-1, 0, 1}};
+
+/// Horizontal pass, padded holds width + 2 * radius border replicated pixels
+static void filterRow(const int32_t *padded, int32_t *smooth, int32_t *diff,
+                      const DerivativeKernel &kernel, int width)
+{
+    const int taps = 2 * kernel.radius + 1;
+    int c = 0;
+    for (; c <= width - mipp::N<int32_t>(); c += mipp::N<int32_t>())
+    {
+        mipp::Reg<int32_t> acc_smooth = mipp::Reg<int32_t>(int32_t(0));
+        mipp::Reg<int32_t> acc_diff = mipp::Reg<int32_t>(int32_t(0));
+        for (int k = 0; k < taps; ++k)
         {
-            if (mag_r[c] > threshold)
-            {
-                // Compute histogram of quantized bins in 3x3 patch around pixel
-                int histogram[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-
-                uchar *patch3x3_row = &quantized_unfiltered(r - 1, c - 1);
-                histogram[patch3x3_row[0]]++;
-                histogram[patch3x3_row[1]]++;
-                histogram[patch3x3_row[2]]++;
-
-                patch3x3_row += quantized_unfiltered.step1();
-                histogram[patch3x3_row[0]]++;
-                histogram[patch3x3_row[1]]++;
-                histogram[patch3x3_row[2]]++;
-
-                patch3x3_row += quantized_unfiltered.step1();
-                histogram[patch3x3_row[0]]++;
-                histogram[patch3x3_row[1]]++;
-                histogram[patch3x3_row[2]]++;
-
-                // Find bin with the most votes from the patch
-                int max_votes = 0;
-                int index = -1;
-                for (int i = 0; i < 8; ++i)
-                {
-                    if (max_votes < histogram[i])
-                    {
-                        index = i;
-                        max_votes = histogram[i];
-                    }
-                }
+            mipp::Reg<int32_t> p(padded + c + k);
+            acc_smooth += p * mipp::Reg<int32_t>(int32_t(kernel.smooth[k]));
+            acc_diff += p * mipp::Reg<int32_t>(int32_t(kernel.diff[k]));
+        }
+        acc_smooth.store(smooth + c);
+        acc_diff.store(diff + c);
+    }
 
-                // Only accept the quantization if majority of pixels in the patch agree
-                static const int NEIGHBOR_THRESHOLD = 5;
-                if (max_votes >= NEIGHBOR_THRESHOLD)
-                    quantized_angle.at<uchar>(r, c) = uchar(1 << index);
-            }
+    for (; c < width; ++c)
+    {
+        int32_t acc_smooth = 0, acc_diff = 0;
+        for (int k = 0; k < taps; ++k)
+        {
+            acc_smooth += padded[c + k] * kernel.smooth[k];
+            acc_diff += padded[c + k] * kernel.diff[k];
         }
+        smooth[c] = acc_smooth;
+        diff[c] = acc_diff;
     }
 }
 
-static void quantizedOrientations(const Mat &src, Mat &magnitude,
-                                  Mat &angle, Mat& angle_ori, float threshold)
+/**
+ * \brief Vertical pass over the 2 * radius + 1 horizontally filtered rows around one output row.
+ *
+ * The shift is logical in MIPP, so sums are biased positive first: BIAS is a multiple of
+ * 2^shift larger than any |sum|, which keeps the result equal to an arithmetic rounding shift.
+ */
+static void combineRows(const int32_t *const *smooth, const int32_t *const *diff, int32_t *dx, int32_t *dy,
+                        const DerivativeKernel &kernel, int width)
 {
-    Mat smoothed;
-    // Compute horizontal and vertical image derivatives on all color channels separately
-    static const int KERNEL_SIZE = 7;
-    // For some reason cvSmooth/cv::GaussianBlur, cvSobel/cv::Sobel have different defaults for border handling...
-    GaussianBlur(src, smoothed, Size(KERNEL_SIZE, KERNEL_SIZE), 0, 0, BORDER_REPLICATE);
+    static const int32_t BIAS = 1 << 27;
+    const int taps = 2 * kernel.radius + 1;
+    const int32_t offset = BIAS + (kernel.shift ? 1 << (kernel.shift - 1) : 0);
+    const int32_t unbias = BIAS >> kernel.shift;
+
+    int c = 0;
+    for (; c <= width - mipp::N<int32_t>(); c += mipp::N<int32_t>())
+    {
+        mipp::Reg<int32_t> acc_dx = mipp::Reg<int32_t>(offset);
+        mipp::Reg<int32_t> acc_dy = mipp::Reg<int32_t>(offset);
+        for (int k = 0; k < taps; ++k)
+        {
+            acc_dx += mipp::Reg<int32_t>(diff[k] + c) * mipp::Reg<int32_t>(int32_t(kernel.smooth[k]));
+            acc_dy += mipp::Reg<int32_t>(smooth[k] + c) * mipp::Reg<int32_t>(int32_t(kernel.diff[k]));
+        }
+        (acc_dx.rshift(kernel.shift) - mipp::Reg<int32_t>(unbias)).store(dx + c);
+        (acc_dy.rshift(kernel.shift) - mipp::Reg<int32_t>(unbias)).store(dy + c);
+    }
 
-    if(src.channels() == 1){
-        Mat sobel_dx, sobel_dy, sobel_ag;
-        Sobel(smoothed, sobel_dx, CV_32F, 1, 0, 3, 1.0, 0.0, BORDER_REPLICATE);
-        Sobel(smoothed, sobel_dy, CV_32F, 0, 1, 3, 1.0, 0.0, BORDER_REPLICATE);
-        magnitude = sobel_dx.mul(sobel_dx) + sobel_dy.mul(sobel_dy);
-        phase(sobel_dx, sobel_dy, sobel_ag, true);
-        hysteresisGradient(magnitude, angle, sobel_ag, threshold * threshold);
-        angle_ori = sobel_ag;
+    for (; c < width; ++c)
+    {
+        int32_t acc_dx = offset, acc_dy = offset;
+        for (int k = 0; k < taps; ++k)
+        {
+            acc_dx += diff[k][c] * kernel.smooth[k];
+            acc_dy += smooth[k][c] * kernel.diff[k];
+        }
+        dx[c] = int32_t(uint32_t(acc_dx) >> kernel.shift) - unbias;
+        dy[c] = int32_t(uint32_t(acc_dy) >> kernel.shift) - unbias;
+    }
+}
 
-    }else{
+/**
+ * \brief Derivatives and squared magnitude of the strongest of 3 channels.
+ *
+ * Ties go to the lowest channel.
+ */
+static void selectStrongestChannel(const int32_t *const *x, const int32_t *const *y,
+                                   int32_t *best_x, int32_t *best_y, int *magnitude, int width)
+{
+    int c = 0;
+    for (; c <= width - mipp::N<int32_t>(); c += mipp::N<int32_t>())
+    {
+        mipp::Reg<int32_t> x0(x[0] + c), x1(x[1] + c), x2(x[2] + c);
+        mipp::Reg<int32_t> y0(y[0] + c), y1(y[1] + c), y2(y[2] + c);
+        mipp::Reg<int32_t> mag0 = x0 * x0 + y0 * y0;
+        mipp::Reg<int32_t> mag1 = x1 * x1 + y1 * y1;
+        mipp::Reg<int32_t> mag2 = x2 * x2 + y2 * y2;
+
+        // Use the gradient orientation of the channel whose magnitude is largest
+        mipp::Msk<mipp::N<int32_t>()> first = (mag0 >= mag1) & (mag0 >= mag2);
+        mipp::Msk<mipp::N<int32_t>()> second = mag1 >= mag2;
+        mipp::blend(x0, mipp::blend(x1, x2, second), first).store(best_x + c);
+        mipp::blend(y0, mipp::blend(y1, y2, second), first).store(best_y + c);
+        mipp::blend(mag0, mipp::blend(mag1, mag2, second), first).store((int32_t *)magnitude + c);
+    }
 
-        magnitude.create(src.size(), CV_32F);
+    for (; c < width; ++c)
+    {
+        int mag0 = x[0][c] * x[0][c] + y[0][c] * y[0][c];
+        int mag1 = x[1][c] * x[1][c] + y[1][c] * y[1][c];
+        int mag2 = x[2][c] * x[2][c] + y[2][c] * y[2][c];
+        int ch = (mag0 >= mag1 && mag0 >= mag2) ? 0 : (mag1 >= mag2 ? 1 : 2);
+        best_x[c] = x[ch][c];
+        best_y[c] = y[ch][c];
+        magnitude[c] = ch == 0 ? mag0 : (ch == 1 ? mag1 : mag2);
+    }
+}
 
-        // Allocate temporary buffers
-        Size size = src.size();
-        Mat sobel_3dx;              // per-channel horizontal derivative
-        Mat sobel_3dy;              // per-channel vertical derivative
-        Mat sobel_dx(size, CV_32F); // maximum horizontal derivative
-        Mat sobel_dy(size, CV_32F); // maximum vertical derivative
-        Mat sobel_ag;               // final gradient orientation (unquantized)
+/**
+ * \brief Smoothed Sobel derivatives of rows [row_begin, row_end) of an 8 bit, 1 or 3 channel source.
+ *
+ * Smoothing and differentiation are fused into one separable fixed-point filter streamed
+ * down the image: each source row is filtered horizontally once into a ring of
+ * 2 * radius + 1 rows, and every output row combines the ring vertically. Borders replicate
+ * the source rows and columns, rows outside the band are read from src, so a band of a
+ * larger image matches the whole-image result exactly. This is not bit exact with GaussianBlur
+ * then Sobel: the blurred image is never rounded to 8 bits, and the first and last row and
+ * column differ more, since the source is replicated once instead of replicating the source for
+ * the blur and then the blurred image for the Sobel. The outputs have
+ * row_end - row_begin rows: dx, dy CV_16S of the strongest channel and its squared
+ * magnitude, CV_32S.
+ */
+static void smoothedDerivatives(const Mat &src, bool smooth, int row_begin, int row_end,
+                                Mat &dx, Mat &dy, Mat &magnitude)
+{
+    CV_Assert(src.depth() == CV_8U && (src.channels() == 1 || src.channels() == 3));
+
+    const DerivativeKernel &kernel = smooth ? BLURRED_SOBEL : SOBEL;
+    const int radius = kernel.radius;
+    const int taps = 2 * radius + 1;
+    const int cn = src.channels();
+    const int width = src.cols;
+
+    dx.create(row_end - row_begin, width, CV_16S);
+    dy.create(row_end - row_begin, width, CV_16S);
+    // Squared magnitudes stay exact in int32, |dx|, |dy| <= 4 * 255 for 8 bit sources
+    magnitude.create(row_end - row_begin, width, CV_32S);
+
+    // Ring slot s of channel ch holds horizontally filtered rows at
+    // ring[((ch * taps + s) * 2 + {0: smooth, 1: diff}) * width]
+    std::vector<int32_t> ring(2 * taps * cn * width);
+    std::vector<int32_t> padded(width + 2 * radius);
+    std::vector<int32_t> planes(2 * (cn + 1) * width);
+    std::vector<const int32_t *> smooth_rows(taps), diff_rows(taps);
+    int32_t *x[3], *y[3];
+    for (int ch = 0; ch < cn; ++ch)
+    {
+        x[ch] = &planes[(2 * ch) * width];
+        y[ch] = &planes[(2 * ch + 1) * width];
+    }
+    int32_t *best_x = &planes[2 * cn * width], *best_y = &planes[(2 * cn + 1) * width];
 
-        Sobel(smoothed, sobel_3dx, CV_16S, 1, 0, 3, 1.0, 0.0, BORDER_REPLICATE);
-        Sobel(smoothed, sobel_3dy, CV_16S, 0, 1, 3, 1.0, 0.0, BORDER_REPLICATE);
+    for (int sr = row_begin - radius; sr < row_end + radius; ++sr)
+    {
+        const int slot = (sr - row_begin + radius) % taps;
+        const uchar *src_r = src.ptr<uchar>(std::min(std::max(sr, 0), src.rows - 1));
+        for (int ch = 0; ch < cn; ++ch)
+        {
+            for (int c = 0; c < radius; ++c)
+            {
+                padded[c] = src_r[ch];
+                padded[width + radius + c] = src_r[(width - 1) * cn + ch];
+            }
+            for (int c = 0; c < width; ++c)
+                padded[radius + c] = src_r[c * cn + ch];
 
-        short *ptrx = (short *)sobel_3dx.data;
-        short *ptry = (short *)sobel_3dy.data;
-        float *ptr0x = (float *)sobel_dx.data;
-        float *ptr0y = (float *)sobel_dy.data;
-        float *ptrmg = (float *)magnitude.data;
+            int32_t *rows = &ring[(ch * taps + slot) * 2 * width];
+            filterRow(&padded[0], rows, rows + width, kernel, width);
+        }
 
-        const int length1 = static_cast<const int>(sobel_3dx.step1());
-        const int length2 = static_cast<const int>(sobel_3dy.step1());
-        const int length3 = static_cast<const int>(sobel_dx.step1());
-        const int length4 = static_cast<const int>(sobel_dy.step1());
-        const int length5 = static_cast<const int>(magnitude.step1());
-        const int length0 = sobel_3dy.cols * 3;
+        // Output row sr - radius has all of its taps once source row sr is in the ring
+        const int r = sr - radius;
+        if (r < row_begin)
+            continue;
 
-        for (int r = 0; r < sobel_3dy.rows; ++r)
+        for (int ch = 0; ch < cn; ++ch)
         {
-            int ind = 0;
-
-            for (int i = 0; i < length0; i += 3)
+            for (int k = 0; k < taps; ++k)
             {
-                // Use the gradient orientation of the channel whose magnitude is largest
-                int mag1 = ptrx[i + 0] * ptrx[i + 0] + ptry[i + 0] * ptry[i + 0];
-                int mag2 = ptrx[i + 1] * ptrx[i + 1] + ptry[i + 1] * ptry[i + 1];
-                int mag3 = ptrx[i + 2] * ptrx[i + 2] + ptry[i + 2] * ptry[i + 2];
-
-                if (mag1 >= mag2 && mag1 >= mag3)
-                {
-                    ptr0x[ind] = ptrx[i];
-                    ptr0y[ind] = ptry[i];
-                    ptrmg[ind] = (float)mag1;
-                }
-                else if (mag2 >= mag1 && mag2 >= mag3)
-                {
-                    ptr0x[ind] = ptrx[i + 1];
-                    ptr0y[ind] = ptry[i + 1];
-                    ptrmg[ind] = (float)mag2;
-                }
-                else
-                {
-                    ptr0x[ind] = ptrx[i + 2];
-                    ptr0y[ind] = ptry[i + 2];
-                    ptrmg[ind] = (float)mag3;
-                }
-                ++ind;
+                const int32_t *rows = &ring[(ch * taps + (r - row_begin + k) % taps) * 2 * width];
+                smooth_rows[k] = rows;
+                diff_rows[k] = rows + width;
             }
-            ptrx += length1;
-            ptry += length2;
-            ptr0x += length3;
-            ptr0y += length4;
-            ptrmg += length5;
+            combineRows(&smooth_rows[0], &diff_rows[0], x[ch], y[ch], kernel, width);
+        }
+
+        int *mag_r = magnitude.ptr<int>(r - row_begin);
+        if (cn == 1)
+        {
+            best_x = x[0];
+            best_y = y[0];
+            for (int c = 0; c < width; ++c)
+                mag_r[c] = best_x[c] * best_x[c] + best_y[c] * best_y[c];
+        }
+        else
+        {
+            selectStrongestChannel(x, y, best_x, best_y, mag_r, width);
         }
 
-        // Calculate the final gradient orientations
-        phase(sobel_dx, sobel_dy, sobel_ag, true);
-        hysteresisGradient(magnitude, angle, sobel_ag, threshold * threshold);
-        angle_ori = sobel_ag;
+        short *dx_r = dx.ptr<short>(r - row_begin);
+        short *dy_r = dy.ptr<short>(r - row_begin);
+        for (int c = 0; c < width; ++c)
+        {
+            dx_r[c] = short(best_x[c]);
+            dy_r[c] = short(best_y[c]);
+        }
     }
+}
 
+static void quantizedOrientations(const Mat &src, Mat &magnitude, Mat &angle, Mat &dx, Mat &dy,
+                                  float threshold, bool smooth)
+{
+    smoothedDerivatives(src, smooth, 0, src.rows, dx, dy, magnitude);
+
+    // Orientation labels straight from the derivatives, feature theta is only computed
+    // from dx, dy when a template is extracted
+    Mat quantized_unfiltered;
+    quantizeGradients(dx, dy, quantized_unfiltered);
+    // mag > threshold^2 for an integer mag is mag > floor(threshold^2)
+    hysteresisGradient(magnitude, angle, quantized_unfiltered, cvFloor(threshold * threshold));
+}
 
+/**
+ * \brief Gradients of rows [row_begin, row_end) only, written into preallocated outputs.
+ *
+ * The derivatives read neighbouring source rows directly. The 3x3 orientation vote needs
+ * the labels of one more row on each side, and hysteresisGradient() resets the outermost
+ * rows of whatever it is given, so the band is processed with a halo of two rows and the
+ * result matches the whole-image computation exactly.
+ */
+static void quantizedOrientations(const Mat &src, Mat &magnitude, Mat &angle, Mat &dx, Mat &dy,
+                                  float threshold, bool smooth, int row_begin, int row_end)
+{
+    static const int HALO = 2;
+    const int halo_begin = std::max(0, row_begin - HALO);
+    const int halo_end = std::min(src.rows, row_end + HALO);
+
+    Mat band_magnitude, band_angle, band_dx, band_dy, quantized_unfiltered;
+    smoothedDerivatives(src, smooth, halo_begin, halo_end, band_dx, band_dy, band_magnitude);
+    quantizeGradients(band_dx, band_dy, quantized_unfiltered);
+    hysteresisGradient(band_magnitude, band_angle, quantized_unfiltered, cvFloor(threshold * threshold));
+
+    Range inner(row_begin - halo_begin, row_end - halo_begin);
+    Mat magnitude_rows = magnitude.rowRange(row_begin, row_end);
+    Mat angle_rows = angle.rowRange(row_begin, row_end);
+    Mat dx_rows = dx.rowRange(row_begin, row_end);
+    Mat dy_rows = dy.rowRange(row_begin, row_end);
+    band_magnitude.rowRange(inner).copyTo(magnitude_rows);
+    band_angle.rowRange(inner).copyTo(angle_rows);
+    band_dx.rowRange(inner).copyTo(dx_rows);
+    band_dy.rowRange(inner).copyTo(dy_rows);
 }
 
 ColorGradientPyramid::ColorGradientPyramid(const Mat &_src, const Mat &_mask,
                                            float _weak_threshold, size_t _num_features,
-                                           float _strong_threshold)
+                                           float _strong_threshold, bool compute_gradients,
+                                           bool _blur_pyramid_levels)
     : src(_src),
       mask(_mask),
       pyramid_level(0),
       weak_threshold(_weak_threshold),
       num_features(_num_features),
-      strong_threshold(_strong_threshold)
+      strong_threshold(_strong_threshold),
+      blur_pyramid_levels(_blur_pyramid_levels)
 {
-    update();
+    if (compute_gradients)
+        update();
+    else
+        allocate();
 }
 
 void ColorGradientPyramid::update()
 {
-    quantizedOrientations(src, magnitude, angle, angle_ori, weak_threshold);
+    quantizedOrientations(src, magnitude, angle, dx, dy, weak_threshold, smoothSource());
+}
+
+void ColorGradientPyramid::allocate()
+{
+    // Fresh buffers, a copied pyramid must not write into the level it was copied from
+    magnitude = Mat(src.size(), CV_32S);
+    angle = Mat(src.size(), CV_8U);
+    dx = Mat(src.size(), CV_16S);
+    dy = Mat(src.size(), CV_16S);
 }
 
-void ColorGradientPyramid::pyrDown()
+void ColorGradientPyramid::update(int row_begin, int row_end)
+{
+    quantizedOrientations(src, magnitude, angle, dx, dy, weak_threshold, smoothSource(), row_begin, row_end);
+}
+
+bool ColorGradientPyramid::smoothSource() const
+{
+    // pyrDown has already Gaussian filtered every level above the first
+    return pyramid_level == 0 || blur_pyramid_levels;
+}
+
+void ColorGradientPyramid::pyrDown(bool compute_gradients)
 {
     // Some parameters need to be adjusted
     num_features /= 2; /// @todo Why not 4?
@@ -413,7 +758,10 @@ void ColorGradientPyramid::pyrDown()
         mask = next_mask;
     }
 
-    update();
+    if (compute_gradients)
+        update();
+    else
+        allocate();
 }
 
 void ColorGradientPyramid::quantize(Mat &dst) const
@@ -434,7 +782,7 @@ bool ColorGradientPyramid::extractTemplate(Template &templ) const
 
     std::vector<Candidate> candidates;
     bool no_mask = local_mask.empty();
-    float threshold_sq = strong_threshold * strong_threshold;
+    int threshold_sq = cvFloor(strong_threshold * strong_threshold);
 
     int nms_kernel_size = 5;
     cv::Mat magnitude_valid = cv::Mat(magnitude.size(), CV_8UC1, cv::Scalar(255));
@@ -447,15 +795,15 @@ bool ColorGradientPyramid::extractTemplate(Template &templ) const
         {
             if (no_mask || mask_r[c])
             {
-                float score = 0;
+                int score = 0;
                 if(magnitude_valid.at<uchar>(r, c)>0){
-                    score = magnitude.at<float>(r, c);
+                    score = magnitude.at<int>(r, c);
                     bool is_max = true;
                     for(int r_offset = -nms_kernel_size/2; r_offset <= nms_kernel_size/2; r_offset++){
                         for(int c_offset = -nms_kernel_size/2; c_offset <= nms_kernel_size/2; c_offset++){
                             if(r_offset == 0 && c_offset == 0) continue;
 
-                            if(score < magnitude.at<float>(r+r_offset, c+c_offset)){
+                            if(score < magnitude.at<int>(r+r_offset, c+c_offset)){
                                 score = 0;
                                 is_max = false;
                                 break;
@@ -476,8 +824,8 @@ bool ColorGradientPyramid::extractTemplate(Template &templ) const
 
                 if (score > threshold_sq && angle.at<uchar>(r, c) > 0)
                 {
-                    candidates.push_back(Candidate(c, r, getLabel(angle.at<uchar>(r, c)), score));
-                    candidates.back().f.theta = angle_ori.at<float>(r, c);
+                    candidates.push_back(Candidate(c, r, getLabel(angle.at<uchar>(r, c)), float(score)));
+                    candidates.back().f.theta = fastAtan2(dy.at<short>(r, c), dx.at<short>(r, c));
                 }
             }
         }
@@ -514,14 +862,16 @@ bool ColorGradientPyramid::extractTemplate(Template &templ) const
 ColorGradient::ColorGradient()
     : weak_threshold(30.0f),
       num_features(63),
-      strong_threshold(60.0f)
+      strong_threshold(60.0f),
+      blur_pyramid_levels(true)
 {
 }
 
 ColorGradient::ColorGradient(float _weak_threshold, size_t _num_features, float _strong_threshold)
     : weak_threshold(_weak_threshold),
       num_features(_num_features),
-      strong_threshold(_strong_threshold)
+      strong_threshold(_strong_threshold),
+      blur_pyramid_levels(true)
 {
 }
 
@@ -540,6 +890,9 @@ void ColorGradient::read(const FileNode &fn)
     weak_threshold = fn["weak_threshold"];
     num_features = int(fn["num_features"]);
     strong_threshold = fn["strong_threshold"];
+    // Older files predate the option and always blurred
+    FileNode blur_node = fn["blur_pyramid_levels"];
+    blur_pyramid_levels = blur_node.empty() || int(blur_node) != 0;
 }
 
 void ColorGradient::write(FileStorage &fs) const
@@ -548,6 +901,7 @@ void ColorGradient::write(FileStorage &fs) const
     fs << "weak_threshold" << weak_threshold;
     fs << "num_features" << int(num_features);
     fs << "strong_threshold" << strong_threshold;
+    fs << "blur_pyramid_levels" << int(blur_pyramid_levels);
 }
 /****************************************************************************************\
 *                                                                 Response maps                                                                                    *
@@ -562,7 +916,7 @@ static void orUnaligned8u(const uchar *src, const int src_stride,
         int c = 0;
 
         // not aligned, which will happen because we move 1 bytes a time for spreading
-        while (reinterpret_cast<unsigned long long>(src + c) % 16 != 0) {
+        while (c < width && reinterpret_cast<unsigned long long>(src + c) % 16 != 0) {
             dst[c] |= src[c];
             c++;
         }
@@ -586,20 +940,53 @@ static void orUnaligned8u(const uchar *src, const int src_stride,
     }
 }
 
-static void spread(const Mat &src, Mat &dst, int T)
+/**
+ * \brief Spread (section 2.3) of quantized rows [r0, r0 + T) into the first T rows of buf.
+ *
+ * Each output pixel is the OR of the T x T window starting at it, pixels past the image
+ * contributing nothing. The window is separable, and a window of width T is built from
+ * doubling ORs (1, 2, 4, ... P with P the largest power of two <= T) plus one shifted OR of
+ * two overlapping P-windows. That is O(log T) row passes instead of T^2.
+ *
+ * \param buf Scratch of (2T - 1) rows by (cols + T) columns, reused across calls.
+ */
+static void spreadBand(const Mat &src, Mat &buf, int r0, int T)
 {
-    // Allocate and zero-initialize spread (OR'ed) image
-    dst = Mat::zeros(src.size(), CV_8U);
+    const int rows = src.rows, cols = src.cols;
+    const int buf_rows = 2 * T - 1, buf_cols = cols + T;
+    buf.create(buf_rows, buf_cols, CV_8U);
+    const int step = static_cast<int>(buf.step1());
+
+    int P = 1;
+    while (P * 2 <= T)
+        P *= 2;
 
-    // Fill in spread gradient image (section 2.3)
-    for (int r = 0; r < T; ++r)
+    // Rows the window can reach, zero padded past the right and bottom borders
+    for (int i = 0; i < buf_rows; ++i)
     {
-        for (int c = 0; c < T; ++c)
+        uchar *dst = buf.ptr(i);
+        if (r0 + i < rows)
+        {
+            std::copy_n(src.ptr(r0 + i), cols, dst);
+            std::fill_n(dst + cols, T, uchar(0));
+        }
+        else
         {
-            orUnaligned8u(&src.at<unsigned char>(r, c), static_cast<const int>(src.step1()), dst.ptr(),
-                          static_cast<const int>(dst.step1()), src.cols - c, src.rows - r);
+            std::fill_n(dst, buf_cols, uchar(0));
         }
     }
+
+    // Horizontal: in place, so each element reads neighbours to its right before they are updated
+    for (int k = 1; k < P; k *= 2)
+        orUnaligned8u(buf.ptr() + k, step, buf.ptr(), step, buf_cols - 2 * k, buf_rows);
+    if (P < T)
+        orUnaligned8u(buf.ptr() + T - P, step, buf.ptr(), step, cols, buf_rows);
+
+    // Vertical, same scheme over rows
+    for (int k = 1; k < P; k *= 2)
+        orUnaligned8u(buf.ptr(k), step, buf.ptr(), step, cols, buf_rows - k);
+    if (P < T)
+        orUnaligned8u(buf.ptr(T - P), step, buf.ptr(), step, cols, T);
 }
 
 static const unsigned char LUT3 = 3;
@@ -607,143 +994,139 @@ static const unsigned char LUT3 = 3;
 CV_DECL_ALIGNED(16)
 static const unsigned char SIMILARITY_LUT[256] = {0, 4, LUT3, 4, 0, 4, LUT3, 4, 0, 4, LUT3, 4, 0, 4, LUT3, 4, 0, 0, 0, 0, 0, 0, 0, 0, LUT3, LUT3, LUT3, LUT3, LUT3, LUT3, LUT3, LUT3, 0, LUT3, 4, 4, LUT3, LUT3, 4, 4, 0, LUT3, 4, 4, LUT3, LUT3, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, LUT3, LUT3, 4, 4, 4, 4, LUT3, LUT3, LUT3, LUT3, 4, 4, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, LUT3, LUT3, LUT3, LUT3, 4, 4, 4, 4, 4, 4, 4, 4, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, 0, 0, 0, 0, 0, 0, 0, LUT3, LUT3, LUT3, LUT3, LUT3, LUT3, LUT3, LUT3, 0, 4, LUT3, 4, 0, 4, LUT3, 4, 0, 4, LUT3, 4, 0, 4, LUT3, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, LUT3, 4, 4, LUT3, LUT3, 4, 4, 0, LUT3, 4, 4, LUT3, LUT3, 4, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, LUT3, LUT3, 4, 4, 4, 4, LUT3, LUT3, LUT3, LUT3, 4, 4, 4, 4, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, LUT3, 0, 0, 0, 0, LUT3, LUT3, LUT3, LUT3, 4, 4, 4, 4, 4, 4, 4, 4};
 
-static void computeResponseMaps(const Mat &src, std::vector<Mat> &response_maps)
+/**
+ * \brief Similarity response of n spread pixels to one orientation, looked up through SIMILARITY_LUT.
+ *
+ * \param lut SIMILARITY_LUT + 32 * orientation.
+ */
+static void computeResponseRow(const uchar *lsb4, const uchar *msb4, uchar *dst, int n, const uchar *lut)
 {
-    CV_Assert((src.rows * src.cols) % 16 == 0);
-
-    // Allocate response maps
-    response_maps.resize(8);
-    for (int i = 0; i < 8; ++i)
-        response_maps[i].create(src.size(), CV_8U);
-
-    Mat lsb4(src.size(), CV_8U);
-    Mat msb4(src.size(), CV_8U);
-
-    for (int r = 0; r < src.rows; ++r)
-    {
-        const uchar *src_r = src.ptr(r);
-        uchar *lsb4_r = lsb4.ptr(r);
-        uchar *msb4_r = msb4.ptr(r);
-
-        for (int c = 0; c < src.cols; ++c)
-        {
-            // Least significant 4 bits of spread image pixel
-            lsb4_r[c] = src_r[c] & 15;
-            // Most significant 4 bits, right-shifted to be in [0, 16)
-            msb4_r[c] = (src_r[c] & 240) >> 4;
-        }
-    }
-
-    {
-        uchar *lsb4_data = lsb4.ptr<uchar>();
-        uchar *msb4_data = msb4.ptr<uchar>();
-
-        bool no_max = true;
-        bool no_shuff = true;
+    bool no_max = true;
+    bool no_shuff = true;
 
 #ifdef has_max_int8_t
-        no_max = false;
+    no_max = false;
 #endif
 
 #ifdef has_shuff_int8_t
-        no_shuff = false;
+    no_shuff = false;
 #endif
-        // LUT is designed for 128 bits SIMD, so quite triky for others
-
-        // For each of the 8 quantized orientations...
-        for (int ori = 0; ori < 8; ++ori){
-            uchar *map_data = response_maps[ori].ptr<uchar>();
-            const uchar *lut_low = SIMILARITY_LUT + 32 * ori;
-
-            if(mipp::N<uint8_t>() == 1 || no_max || no_shuff){ // no SIMD
-                for (int i = 0; i < src.rows * src.cols; ++i)
-                    map_data[i] = std::max(lut_low[lsb4_data[i]], lut_low[msb4_data[i] + 16]);
-            }
-            else if(mipp::N<uint8_t>() == 16){ // 128 SIMD, no add base
-
-                const uchar *lut_low = SIMILARITY_LUT + 32 * ori;
-                mipp::Reg<uint8_t> lut_low_v((uint8_t*)lut_low);
-                mipp::Reg<uint8_t> lut_high_v((uint8_t*)lut_low + 16);
+    // LUT is designed for 128 bits SIMD, so quite triky for others
 
-                for (int i = 0; i < src.rows * src.cols; i += mipp::N<uint8_t>()){
-                    mipp::Reg<uint8_t> low_mask((uint8_t*)lsb4_data + i);
-                    mipp::Reg<uint8_t> high_mask((uint8_t*)msb4_data + i);
+    int i = 0;
+    if(mipp::N<uint8_t>() == 1 || no_max || no_shuff){ // no SIMD
+    }
+    else if(mipp::N<uint8_t>() == 16){ // 128 SIMD, no add base
+        mipp::Reg<uint8_t> lut_low_v((uint8_t*)lut);
+        mipp::Reg<uint8_t> lut_high_v((uint8_t*)lut + 16);
 
-                    mipp::Reg<uint8_t> low_res = mipp::shuff(lut_low_v, low_mask);
-                    mipp::Reg<uint8_t> high_res = mipp::shuff(lut_high_v, high_mask);
+        for (; i <= n - mipp::N<uint8_t>(); i += mipp::N<uint8_t>()){
+            mipp::Reg<uint8_t> low_mask((uint8_t*)lsb4 + i);
+            mipp::Reg<uint8_t> high_mask((uint8_t*)msb4 + i);
 
-                    mipp::Reg<uint8_t> result = mipp::max(low_res, high_res);
-                    result.store((uint8_t*)map_data + i);
-                }
-            }
-            else if(mipp::N<uint8_t>() == 16 || mipp::N<uint8_t>() == 32
-                    || mipp::N<uint8_t>() == 64){ //128 256 512 SIMD
-                CV_Assert((src.rows * src.cols) % mipp::N<uint8_t>() == 0);
+            mipp::Reg<uint8_t> low_res = mipp::shuff(lut_low_v, low_mask);
+            mipp::Reg<uint8_t> high_res = mipp::shuff(lut_high_v, high_mask);
 
-                uint8_t lut_temp[mipp::N<uint8_t>()] = {0};
+            mipp::Reg<uint8_t> result = mipp::max(low_res, high_res);
+            result.store((uint8_t*)dst + i);
+        }
+    }
+    else if(mipp::N<uint8_t>() == 32 || mipp::N<uint8_t>() == 64){ // 256 512 SIMD
+        uint8_t lut_temp[mipp::N<uint8_t>()] = {0};
 
-                for(int slice=0; slice<mipp::N<uint8_t>()/16; slice++){
-                    std::copy_n(lut_low, 16, lut_temp+slice*16);
-                }
-                mipp::Reg<uint8_t> lut_low_v(lut_temp);
+        for(int slice=0; slice<mipp::N<uint8_t>()/16; slice++){
+            std::copy_n(lut, 16, lut_temp+slice*16);
+        }
+        mipp::Reg<uint8_t> lut_low_v(lut_temp);
 
-                uint8_t base_add_array[mipp::N<uint8_t>()] = {0};
-                for(uint8_t slice=0; slice<mipp::N<uint8_t>(); slice+=16){
-                    std::copy_n(lut_low+16, 16, lut_temp+slice);
-                    std::fill_n(base_add_array+slice, 16, slice);
-                }
-                mipp::Reg<uint8_t> base_add(base_add_array);
-                mipp::Reg<uint8_t> lut_high_v(lut_temp);
+        uint8_t base_add_array[mipp::N<uint8_t>()] = {0};
+        for(uint8_t slice=0; slice<mipp::N<uint8_t>(); slice+=16){
+            std::copy_n(lut+16, 16, lut_temp+slice);
+            std::fill_n(base_add_array+slice, 16, slice);
+        }
+        mipp::Reg<uint8_t> base_add(base_add_array);
+        mipp::Reg<uint8_t> lut_high_v(lut_temp);
 
-                for (int i = 0; i < src.rows * src.cols; i += mipp::N<uint8_t>()){
-                    mipp::Reg<uint8_t> mask_low_v((uint8_t*)lsb4_data+i);
-                    mipp::Reg<uint8_t> mask_high_v((uint8_t*)msb4_data+i);
+        for (; i <= n - mipp::N<uint8_t>(); i += mipp::N<uint8_t>()){
+            mipp::Reg<uint8_t> mask_low_v((uint8_t*)lsb4+i);
+            mipp::Reg<uint8_t> mask_high_v((uint8_t*)msb4+i);
 
-                    mask_low_v += base_add;
-                    mask_high_v += base_add;
+            mask_low_v += base_add;
+            mask_high_v += base_add;
 
-                    mipp::Reg<uint8_t> shuff_low_result = mipp::shuff(lut_low_v, mask_low_v);
-                    mipp::Reg<uint8_t> shuff_high_result = mipp::shuff(lut_high_v, mask_high_v);
+            mipp::Reg<uint8_t> shuff_low_result = mipp::shuff(lut_low_v, mask_low_v);
+            mipp::Reg<uint8_t> shuff_high_result = mipp::shuff(lut_high_v, mask_high_v);
 
-                    mipp::Reg<uint8_t> result = mipp::max(shuff_low_result, shuff_high_result);
-                    result.store((uint8_t*)map_data + i);
-                }
-            }
-            else{
-                for (int i = 0; i < src.rows * src.cols; ++i)
-                    map_data[i] = std::max(lut_low[lsb4_data[i]], lut_low[msb4_data[i] + 16]);
-            }
+            mipp::Reg<uint8_t> result = mipp::max(shuff_low_result, shuff_high_result);
+            result.store((uint8_t*)dst + i);
         }
+    }
 
+    for (; i < n; ++i)
+        dst[i] = std::max(lut[lsb4[i]], lut[msb4[i] + 16]);
+}
 
-    }
+/**
+ * \brief Allocate the 8 linear memories of a quantized image, T^2 rows each.
+ */
+static void allocateLinearMemories(Size size, std::vector<Mat> &memories, int T)
+{
+    CV_Assert(size.height % T == 0);
+    CV_Assert(size.width % T == 0);
+
+    memories.resize(8);
+    for (int ori = 0; ori < 8; ++ori)
+        memories[ori].create(T * T, (size.width / T) * (size.height / T), CV_8U);
 }
 
-static void linearize(const Mat &response_map, Mat &linearized, int T)
+/**
+ * \brief Spread, response maps and linearization of a quantized image in one pass.
+ *
+ * Works one band of T rows at a time: the band is spread into a small buffer, each row is
+ * turned into the 8 orientation responses, and those are written straight into the linear
+ * memories. No full-size spread image or response map is ever allocated.
+ *
+ * Only bands [band_begin, band_end) are filled, so disjoint band ranges can run in parallel.
+ *
+ * \param[out] memories From allocateLinearMemories(), see the layout in accessLinearMemory().
+ */
+static void computeLinearMemories(const Mat &quantized, std::vector<Mat> &memories, int T,
+                                  int band_begin, int band_end)
 {
-    CV_Assert(response_map.rows % T == 0);
-    CV_Assert(response_map.cols % T == 0);
+    const int cols = quantized.cols;
+    const int mem_width = cols / T;
 
-    // linearized has T^2 rows, where each row is a linear memory
-    int mem_width = response_map.cols / T;
-    int mem_height = response_map.rows / T;
-    linearized.create(T * T, mem_width * mem_height, CV_8U);
+    Mat band;
+    std::vector<uchar> lsb4(cols), msb4(cols), response(cols);
 
-    // Outer two for loops iterate over top-left T^2 starting pixels
-    int index = 0;
-    for (int r_start = 0; r_start < T; ++r_start)
+    for (int band_r = band_begin; band_r < band_end; ++band_r)
     {
-        for (int c_start = 0; c_start < T; ++c_start)
+        // Fill in spread gradient image for rows [band_r * T, band_r * T + T)
+        spreadBand(quantized, band, band_r * T, T);
+
+        for (int r = 0; r < T; ++r)
         {
-            uchar *memory = linearized.ptr(index);
-            ++index;
+            const uchar *spread_r = band.ptr(r);
+            for (int c = 0; c < cols; ++c)
+            {
+                // Least significant 4 bits of spread image pixel
+                lsb4[c] = spread_r[c] & 15;
+                // Most significant 4 bits, right-shifted to be in [0, 16)
+                msb4[c] = (spread_r[c] & 240) >> 4;
+            }
 
-            // Inner two loops copy every T-th pixel into the linear memory
-            for (int r = r_start; r < response_map.rows; r += T)
+            // For each of the 8 quantized orientations...
+            for (int ori = 0; ori < 8; ++ori)
             {
-                const uchar *response_data = response_map.ptr(r);
-                for (int c = c_start; c < response_map.cols; c += T)
-                    *memory++ = response_data[c];
+                computeResponseRow(lsb4.data(), msb4.data(), response.data(), cols, SIMILARITY_LUT + 32 * ori);
+
+                // Every T-th pixel goes to the linear memory of its offset inside the T x T grid
+                for (int c_start = 0; c_start < T; ++c_start)
+                {
+                    uchar *memory = memories[ori].ptr(r * T + c_start) + band_r * mem_width;
+                    for (int c = c_start, k = 0; c < cols; c += T, ++k)
+                        memory[k] = response[c];
+                }
             }
         }
     }
@@ -777,246 +1160,578 @@ static const unsigned char *accessLinearMemory(const std::vector<Mat> &linear_me
     return memory + lm_index;
 }
 
-static void similarity(const std::vector<Mat> &linear_memories, const Template &templ,
-                       Mat &dst, Size size, int T)
+/// Linear memory of a feature moved by (shift_x, shift_y) * T, see Template::linearize()
+static const unsigned char *accessLinearMemory(const std::vector<Mat> &linear_memories,
+                                               const Template::LinearFeature &f, int W,
+                                               int shift_x = 0, int shift_y = 0)
 {
-    // we only have one modality, so 8192*2, due to mipp, back to 8192
-    CV_Assert(templ.features.size() < 8192);
-
-    // Decimate input image size by factor of T
-    int W = size.width / T;
-    int H = size.height / T;
-
-    // Feature dimensions, decimated by factor T and rounded up
-    int wf = (templ.width - 1) / T + 1;
-    int hf = (templ.height - 1) / T + 1;
-
-    // Span is the range over which we can shift the template around the input image
-    int span_x = W - wf;
-    int span_y = H - hf;
-
-    int template_positions = span_y * W + span_x + 1; // why add 1?
+    const Mat &memory_grid = linear_memories[f.label];
+    CV_DbgAssert(f.grid_index >= 0 && f.grid_index < memory_grid.rows);
+    int lm_index = (f.lm_y + shift_y) * W + f.lm_x + shift_x;
+    CV_DbgAssert(lm_index >= 0);
+    CV_DbgAssert(lm_index < memory_grid.cols);
+    return memory_grid.ptr(f.grid_index) + lm_index;
+}
 
-    dst = Mat::zeros(H, W, CV_16U);
-    short *dst_ptr = dst.ptr<short>();
-    mipp::Reg<uint8_t> zero_v(uint8_t(0));
+// Most features whose responses (at most 4 each) one int16 accumulator can sum
+static const int MAX_INT16_FEATURES = 8191;
 
-    for (int i = 0; i < (int)templ.features.size(); ++i)
+/// Append base + i and acc[i] for every i < count with acc[i] >= min_raw
+template <typename T>
+static void collectAbove(const T *acc, int count, int min_raw, int base,
+                         std::vector<int> &positions, std::vector<int> &scores)
+{
+    mipp::Reg<T> bound_v(T(std::min<int>(min_raw, std::numeric_limits<T>::max()) - 1));
+    for (int i = 0; i < count; i += mipp::N<T>())
     {
-
-        Feature f = templ.features[i];
-
-        if (f.x < 0 || f.x >= size.width || f.y < 0 || f.y >= size.height)
+        // Skip whole registers below the threshold, most of them
+        if (i + mipp::N<T>() <= count && (mipp::Reg<T>(acc + i) > bound_v).testz())
             continue;
-        const uchar *lm_ptr = accessLinearMemory(linear_memories, f, T, W);
-
-        int j = 0;
-
-        // *2 to avoid int8 read out of range
-        for(; j <= template_positions -mipp::N<int16_t>()*2; j+=mipp::N<int16_t>()){
-            mipp::Reg<uint8_t> src8_v((uint8_t*)lm_ptr + j);
-
-            // uchar to short, once for N bytes
-            mipp::Reg<int16_t> src16_v(mipp::interleavelo(src8_v, zero_v).r);
+        for (int lane = i; lane < std::min(i + mipp::N<T>(), count); ++lane)
+        {
+            if (acc[lane] >= min_raw)
+            {
+                positions.push_back(base + lane);
+                scores.push_back(acc[lane]);
+            }
+        }
+    }
+}
 
-            mipp::Reg<int16_t> dst_v((int16_t*)dst_ptr + j);
+/**
+ * \brief Register r of an S x S byte window at lm_ptr, rows W apart, holding BYTES bytes of it.
+ *
+ * Rows of at least BYTES bytes are loaded directly. Shorter rows are packed BYTES / S to a
+ * register without a staging buffer: the load for row k starts k * S bytes before it, which
+ * puts the row on bytes [k * S, (k + 1) * S) of the register, and segments[k] blends those
+ * int32 lanes in. Bytes past BYTES are unspecified.
+ */
+template <int S, int BYTES>
+static mipp::Reg<uint8_t> loadWindowRegister(const uchar *lm_ptr, int W, int r,
+                                             const mipp::Msk<mipp::N<int32_t>()> *segments)
+{
+    if (BYTES <= S)
+    {
+        const int per_row = S / BYTES;
+        return mipp::Reg<uint8_t>((uint8_t *)lm_ptr + (r / per_row) * W + (r % per_row) * BYTES);
+    }
 
-            mipp::Reg<int16_t> res_v = src16_v + dst_v;
-            res_v.store((int16_t*)dst_ptr + j);
-        }
+    const int rows = BYTES / S;
+    const uchar *row_ptr = lm_ptr + r * rows * W;
+    mipp::Reg<int32_t> packed((const int32_t *)row_ptr);
+    for (int k = 1; k < rows; ++k)
+        packed = mipp::blend(mipp::Reg<int32_t>((const int32_t *)(row_ptr + k * (W - S))), packed, segments[k]);
+    return mipp::Reg<uint8_t>(packed.r);
+}
 
-        for(; j<template_positions; j++)
-            dst_ptr[j] += short(lm_ptr[j]);
+/// Int32 lanes holding bytes [k * S, (k + 1) * S), for every row k packed by loadWindowRegister()
+template <int S, int BYTES>
+static void windowSegments(mipp::Msk<mipp::N<int32_t>()> *segments)
+{
+    for (int k = 0; k < BYTES / S; ++k)
+    {
+        bool lanes[mipp::N<int32_t>()];
+        for (int l = 0; l < mipp::N<int32_t>(); ++l)
+            lanes[l] = l * 4 / S == k;
+        segments[k] = mipp::Msk<mipp::N<int32_t>()>(lanes);
     }
 }
 
+// Whether loadWindowRegister() covers an S x S window in registers of BYTES bytes
+static constexpr bool windowInRegisters(int S, int bytes)
+{
+    return (S % bytes == 0 || bytes % S == 0) && S * S >= bytes;
+}
+
+/**
+ * \brief Similarity of linear features [feature_begin, feature_end) in the S x S window around center.
+ *
+ * All features by default. Entry (r, c) of the CV_16U result is the template placed at
+ * (center / T - S / 2 + (c, r)) * T. The window stays in registers across all features
+ * and is stored once at the end.
+ */
+template <int S>
 static void similarityLocal(const std::vector<Mat> &linear_memories, const Template &templ,
-                            Mat &dst, Size size, int T, Point center)
+                            Mat &dst, Size size, int T, Point center,
+                            int feature_begin = 0, int feature_end = -1)
 {
-    CV_Assert(templ.features.size() < 8192);
+    if (feature_end < 0)
+        feature_end = static_cast<int>(templ.linear_features.size());
+    CV_Assert(feature_end - feature_begin <= MAX_INT16_FEATURES);
 
     int W = size.width / T;
-    dst = Mat::zeros(16, 16, CV_16U);
+    dst = Mat::zeros(S, S, CV_16U);
+    int16_t *dst_ptr = dst.ptr<int16_t>();
+
+    int offset_x = (center.x / T - S / 2) * T;
+    int offset_y = (center.y / T - S / 2) * T;
 
-    int offset_x = (center.x / T - 8) * T;
-    int offset_y = (center.y / T - 8) * T;
-    mipp::Reg<uint8_t> zero_v = uint8_t(0);
+    // Widening only uses the low half of a uint8 register
+    const int N = mipp::N<int16_t>();
+    const int REGS = (S * S + N - 1) / N;
+    const bool in_registers = windowInRegisters(S, N);
+    mipp::Reg<uint8_t> zero_v(uint8_t(0));
+    mipp::Msk<mipp::N<int32_t>()> segments[N / S + 1];
+    windowSegments<S, N>(segments);
+    mipp::Reg<int16_t> acc[REGS];
+    for (int r = 0; r < REGS; ++r)
+        acc[r] = mipp::Reg<int16_t>(int16_t(0));
 
-    for (int i = 0; i < (int)templ.features.size(); ++i)
+    for (int i = feature_begin; i < feature_end; ++i)
     {
-        Feature f = templ.features[i];
-        f.x += offset_x;
-        f.y += offset_y;
+        const Template::LinearFeature &f = templ.linear_features[i];
+        int x = f.x + offset_x;
+        int y = f.y + offset_y;
         // Discard feature if out of bounds, possibly due to applying the offset
-        if (f.x < 0 || f.y < 0 || f.x >= size.width || f.y >= size.height)
+        if (x < 0 || y < 0 || x >= size.width || y >= size.height)
             continue;
 
-        const uchar *lm_ptr = accessLinearMemory(linear_memories, f, T, W);
+        const uchar *lm_ptr = accessLinearMemory(linear_memories, f, W, offset_x / T, offset_y / T);
+        if (in_registers)
         {
-            short *dst_ptr = dst.ptr<short>();
-
-            if(mipp::N<uint8_t>() > 32){ //512 bits SIMD
-                for (int row = 0; row < 16; row += mipp::N<int16_t>()/16){
-                    mipp::Reg<int16_t> dst_v((int16_t*)dst_ptr + row*16);
-
-                    // load lm_ptr, 16 bytes once, for half
-                    uint8_t local_v[mipp::N<uint8_t>()] = {0};
-                    for(int slice=0; slice<mipp::N<uint8_t>()/16/2; slice++){
-                        std::copy_n(lm_ptr, 16, &local_v[16*slice]);
-                        lm_ptr += W;
-                    }
-                    mipp::Reg<uint8_t> src8_v(local_v);
-                    // uchar to short, once for N bytes
-                    mipp::Reg<int16_t> src16_v(mipp::interleavelo(src8_v, zero_v).r);
-
-                    mipp::Reg<int16_t> res_v = src16_v + dst_v;
-                    res_v.store((int16_t*)dst_ptr);
-
-                    dst_ptr += mipp::N<int16_t>();
-                }
-            }else{ // 256 128 or no SIMD
-                for (int row = 0; row < 16; ++row){
-                    for(int col=0; col<16; col+=mipp::N<int16_t>()){
-                        mipp::Reg<uint8_t> src8_v((uint8_t*)lm_ptr + col);
-
-                        // uchar to short, once for N bytes
-                        mipp::Reg<int16_t> src16_v(mipp::interleavelo(src8_v, zero_v).r);
-
-                        mipp::Reg<int16_t> dst_v((int16_t*)dst_ptr + col);
-                        mipp::Reg<int16_t> res_v = src16_v + dst_v;
-                        res_v.store((int16_t*)dst_ptr + col);
-                    }
-                    dst_ptr += 16;
-                    lm_ptr += W;
-                }
+            for (int r = 0; r < REGS; ++r)
+            {
+                mipp::Reg<uint8_t> src8_v = loadWindowRegister<S, N>(lm_ptr, W, r, segments);
+                // uchar to short, once for N bytes
+                acc[r] += mipp::Reg<int16_t>(mipp::interleavelo(src8_v, zero_v).r);
+            }
+        }
+        else
+        {
+            for (int row = 0; row < S; ++row)
+            {
+                for (int col = 0; col < S; ++col)
+                    dst_ptr[row * S + col] += lm_ptr[row * W + col];
             }
         }
     }
+
+    if (in_registers)
+    {
+        for (int r = 0; r < REGS; ++r)
+            acc[r].store(dst_ptr + r * N);
+    }
 }
 
-static void similarity_64(const std::vector<Mat> &linear_memories, const Template &templ,
-                          Mat &dst, Size size, int T)
+/**
+ * \brief similarityLocal() for templates with more than MAX_INT16_FEATURES features, CV_32S result.
+ *
+ * Features are summed in int16 runs of MAX_INT16_FEATURES, each run spilled into the int32 map.
+ */
+template <int S>
+static void similarityLocal_32(const std::vector<Mat> &linear_memories, const Template &templ,
+                               Mat &dst, Size size, int T, Point center)
 {
-    // 63 features or less is a special case because the max similarity per-feature is 4.
-    // 255/4 = 63, so up to that many we can add up similarities in 8 bits without worrying
-    // about overflow. Therefore here we use _mm_add_epi8 as the workhorse, whereas a more
-    // general function would use _mm_add_epi16.
-    CV_Assert(templ.features.size() < 64);
-    /// @todo Handle more than 255/MAX_RESPONSE features!!
+    dst = Mat::zeros(S, S, CV_32S);
+    int *dst_ptr = dst.ptr<int>();
 
-    // Decimate input image size by factor of T
-    int W = size.width / T;
-    int H = size.height / T;
+    Mat run;
+    const int num_features = static_cast<int>(templ.linear_features.size());
+    for (int begin = 0; begin < num_features; begin += MAX_INT16_FEATURES)
+    {
+        similarityLocal<S>(linear_memories, templ, run, size, T, center,
+                           begin, std::min(begin + MAX_INT16_FEATURES, num_features));
+        const ushort *run_ptr = run.ptr<ushort>();
+        for (int i = 0; i < S * S; ++i)
+            dst_ptr[i] += run_ptr[i];
+    }
+}
+
+/**
+ * \brief Whole-image similarity of several templates at once, keeping positions that reach min_raw.
+ *
+ * Position j stands for the template placed at (j % W, j / W) * T, W = size.width / T, and
+ * scores the summed response of its features. Like the original LINEMOD code, positions
+ * are scanned as one contiguous run of the linear memories, so placements wrapping around
+ * the right border are included and must be filtered out by the caller if they matter.
+ *
+ * Positions are processed in tiles small enough for all accumulators to stay in cache,
+ * and each tile is thresholded as soon as it is complete, so no full similarity map is
+ * ever allocated. Within a tile the linear features of all templates are merged, so a
+ * linear memory span shared by several templates (same label, grid row and position) is
+ * loaded once and added into each of their accumulators, and spans merely close to each
+ * other are read from cache rather than memory by every template but the first.
+ *
+ * \param      min_raw   Per template, the lowest raw score kept.
+ * \param[out] positions Per template, surviving positions in increasing order.
+ * \param[out] scores    Per template, raw scores of those positions.
+ */
+static void similarityBlock(const std::vector<Mat> &linear_memories, const std::vector<const Template *> &templs,
+                            const std::vector<int> &min_raw, std::vector<std::vector<int>> &positions,
+                            std::vector<std::vector<int>> &scores, Size size, int T)
+{
+    static const int TILE = 2048;
+
+    const int K = static_cast<int>(templs.size());
+    const int W = size.width / T;
+    const int H = size.height / T;
+
+    // Features of all templates, merged in linear memory order within each int16 run
+    struct Span
+    {
+        const Template::LinearFeature *f;
+        int slot;
+        int run;
+    };
+    std::vector<Span> spans;
+    std::vector<int> template_positions(K);
+    int max_positions = 0;
+    int runs = 1;
+    for (int k = 0; k < K; ++k)
+    {
+        const Template &templ = *templs[k];
+
+        int wf = (templ.width - 1) / T + 1;
+        int hf = (templ.height - 1) / T + 1;
+        template_positions[k] = (H - hf) * W + (W - wf) + 1;
+        max_positions = std::max(max_positions, template_positions[k]);
+
+        int valid = 0;
+        for (size_t i = 0; i < templ.linear_features.size(); ++i)
+        {
+            const Template::LinearFeature &f = templ.linear_features[i];
+            if (f.x < 0 || f.x >= size.width || f.y < 0 || f.y >= size.height)
+                continue;
+            Span span = {&f, k, valid++ / MAX_INT16_FEATURES};
+            spans.push_back(span);
+            runs = std::max(runs, span.run + 1);
+        }
+    }
+    std::stable_sort(spans.begin(), spans.end(), [](const Span &a, const Span &b) {
+        if (a.run != b.run)
+            return a.run < b.run;
+        if (a.f->label != b.f->label)
+            return a.f->label < b.f->label;
+        if (a.f->grid_index != b.f->grid_index)
+            return a.f->grid_index < b.f->grid_index;
+        if (a.f->lm_y != b.f->lm_y)
+            return a.f->lm_y < b.f->lm_y;
+        return a.f->lm_x < b.f->lm_x;
+    });
+
+    positions.assign(K, std::vector<int>());
+    scores.assign(K, std::vector<int>());
+    if (max_positions <= 0)
+        return;
+
+    std::vector<int16_t> acc(K * TILE);
+    // Only templates with more than MAX_INT16_FEATURES features need a second run, whose
+    // int16 sums are spilled into int32 totals
+    std::vector<int32_t> total(runs > 1 ? K * TILE : 0);
+    mipp::Reg<uint8_t> zero_v(uint8_t(0));
+
+    for (int tile_begin = 0; tile_begin < max_positions; tile_begin += TILE)
+    {
+        const int tile_end = std::min(tile_begin + TILE, max_positions);
+        std::fill(total.begin(), total.end(), 0);
+
+        for (size_t s = 0; s < spans.size();)
+        {
+            std::fill(acc.begin(), acc.end(), int16_t(0));
+            const int run = spans[s].run;
+
+            for (; s < spans.size() && spans[s].run == run;)
+            {
+                // Group the templates reading exactly this span
+                const Template::LinearFeature &f = *spans[s].f;
+                size_t group_end = s + 1;
+                while (group_end < spans.size() && spans[group_end].run == run &&
+                       spans[group_end].f->label == f.label && spans[group_end].f->grid_index == f.grid_index &&
+                       spans[group_end].f->lm_y == f.lm_y && spans[group_end].f->lm_x == f.lm_x)
+                    ++group_end;
+
+                // Every owner only needs positions below its own template_positions, which never
+                // read past the end of the linear memory
+                int limit = 0;
+                for (size_t g = s; g < group_end; ++g)
+                    limit = std::max(limit, template_positions[spans[g].slot]);
+                const uchar *lm_ptr = accessLinearMemory(linear_memories, f, W);
+                limit = std::min(limit, linear_memories[f.label].cols - (f.lm_y * W + f.lm_x));
+                const int end = std::min(tile_end, limit);
+
+                int j = tile_begin;
+                // *2 to avoid int8 read out of range
+                for (; j <= end - mipp::N<int16_t>() * 2; j += mipp::N<int16_t>())
+                {
+                    mipp::Reg<uint8_t> src8_v((uint8_t *)lm_ptr + j);
+                    mipp::Reg<int16_t> src16_v(mipp::interleavelo(src8_v, zero_v).r);
+                    for (size_t g = s; g < group_end; ++g)
+                    {
+                        int16_t *acc_ptr = &acc[spans[g].slot * TILE + j - tile_begin];
+                        (mipp::Reg<int16_t>(acc_ptr) + src16_v).store(acc_ptr);
+                    }
+                }
+                for (; j < end; ++j)
+                {
+                    for (size_t g = s; g < group_end; ++g)
+                        acc[spans[g].slot * TILE + j - tile_begin] += lm_ptr[j];
+                }
+
+                s = group_end;
+            }
+
+            // Once per MAX_INT16_FEATURES features, cheap enough to leave to the compiler
+            if (runs > 1)
+            {
+                for (size_t i = 0; i < acc.size(); ++i)
+                    total[i] += acc[i];
+            }
+        }
 
-    // Feature dimensions, decimated by factor T and rounded up
+        for (int k = 0; k < K; ++k)
+        {
+            const int count = std::min(tile_end, template_positions[k]) - tile_begin;
+            if (runs > 1)
+                collectAbove(&total[k * TILE], count, min_raw[k], tile_begin, positions[k], scores[k]);
+            else
+                collectAbove(&acc[k * TILE], count, min_raw[k], tile_begin, positions[k], scores[k]);
+        }
+    }
+}
+
+/**
+ * \brief Coarse similarity with early rejection, returns only the positions scoring at least min_raw.
+ *
+ * Positions are processed in blocks of one int16 register. Features are accumulated in
+ * template order, which is by decreasing gradient magnitude, a chunk at a time; after each
+ * chunk a block is dropped once none of its positions can reach min_raw even if every
+ * remaining feature responded with the maximum of 4. Positions cover the same range as
+ * similarityBlock(), in row-major order with row length size.width / T.
+ *
+ * Templates with more than MAX_INT16_FEATURES features spill the int16 sums into int32
+ * totals every SPILL features, blocks are then only rejected at those points.
+ */
+static void similarityBounded(const std::vector<Mat> &linear_memories, const Template &templ,
+                              Size size, int T, int min_raw,
+                              std::vector<int> &positions, std::vector<int> &scores)
+{
+    static const int FEATURE_CHUNK = 8;
+    static const int SPILL = MAX_INT16_FEATURES / FEATURE_CHUNK * FEATURE_CHUNK;
+    static const int MAX_RESPONSE = 4;
+
+    positions.clear();
+    scores.clear();
+
+    // Same geometry as similarityBlock()
+    int W = size.width / T;
+    int H = size.height / T;
     int wf = (templ.width - 1) / T + 1;
     int hf = (templ.height - 1) / T + 1;
-
-    // Span is the range over which we can shift the template around the input image
     int span_x = W - wf;
     int span_y = H - hf;
+    int template_positions = span_y * W + span_x + 1;
+    if (template_positions <= 0)
+        return;
 
-    // Compute number of contiguous (in memory) pixels to check when sliding feature over
-    // image. This allows template to wrap around left/right border incorrectly, so any
-    // wrapped template matches must be filtered out!
-    int template_positions = span_y * W + span_x + 1; // why add 1?
-    //int template_positions = (span_y - 1) * W + span_x; // More correct?
-
-    /// @todo In old code, dst is buffer of size m_U. Could make it something like
-    /// (span_x)x(span_y) instead?
-    dst = Mat::zeros(H, W, CV_8U);
-    uchar *dst_ptr = dst.ptr<uchar>();
-
-    // Compute the similarity measure for this template by accumulating the contribution of
-    // each feature
-    for (int i = 0; i < (int)templ.features.size(); ++i)
-    {
-        // Add the linear memory at the appropriate offset computed from the location of
-        // the feature in the template
-        Feature f = templ.features[i];
-        // Discard feature if out of bounds
-        /// @todo Shouldn't actually see x or y < 0 here?
+    std::vector<const uchar *> lm_ptrs;
+    lm_ptrs.reserve(templ.features.size());
+    for (size_t i = 0; i < templ.features.size(); ++i)
+    {
+        const Feature &f = templ.features[i];
         if (f.x < 0 || f.x >= size.width || f.y < 0 || f.y >= size.height)
             continue;
-        const uchar *lm_ptr = accessLinearMemory(linear_memories, f, T, W);
+        lm_ptrs.push_back(accessLinearMemory(linear_memories, f, T, W));
+    }
+    const int num_valid = static_cast<int>(lm_ptrs.size());
+    if (MAX_RESPONSE * num_valid < min_raw)
+        return;
+
+    // Surviving blocks and their accumulators, compacted as blocks are rejected
+    const int B = mipp::N<int16_t>();
+    std::vector<int> blocks;
+    for (int j = 0; j < template_positions; j += B)
+        blocks.push_back(j);
+    std::vector<int16_t> acc(blocks.size() * B, 0);
+    const bool wide = num_valid > MAX_INT16_FEATURES;
+    std::vector<int32_t> total(wide ? acc.size() : 0, 0);
+    mipp::Reg<uint8_t> zero_v(uint8_t(0));
+
+    for (int done = 0; done < num_valid && !blocks.empty();)
+    {
+        const int end = std::min(done + FEATURE_CHUNK, num_valid);
+        for (size_t k = 0; k < blocks.size(); ++k)
+        {
+            const int j = blocks[k];
+            int16_t *acc_ptr = &acc[k * B];
+            // A uint8 register holds 2 * B bytes, do not read past the last position
+            if (j + 2 * B <= template_positions)
+            {
+                mipp::Reg<int16_t> acc_v(acc_ptr);
+                for (int i = done; i < end; ++i)
+                {
+                    mipp::Reg<uint8_t> src8_v((uint8_t *)lm_ptrs[i] + j);
+                    acc_v += mipp::Reg<int16_t>(mipp::interleavelo(src8_v, zero_v).r);
+                }
+                acc_v.store(acc_ptr);
+            }
+            else
+            {
+                const int lanes = std::min(B, template_positions - j);
+                for (int i = done; i < end; ++i)
+                {
+                    for (int lane = 0; lane < lanes; ++lane)
+                        acc_ptr[lane] += lm_ptrs[i][j + lane];
+                }
+            }
+        }
+        done = end;
 
-        // Now we do an aligned/unaligned add of dst_ptr and lm_ptr with template_positions elements
-        int j = 0;
+        if (wide)
+        {
+            if (done % SPILL != 0 && done != num_valid)
+                continue;
+            for (size_t i = 0; i < blocks.size() * B; ++i)
+            {
+                total[i] += acc[i];
+                acc[i] = 0;
+            }
+        }
 
-        for(; j <= template_positions -mipp::N<uint8_t>(); j+=mipp::N<uint8_t>()){
-            mipp::Reg<uint8_t> src_v((uint8_t*)lm_ptr + j);
-            mipp::Reg<uint8_t> dst_v((uint8_t*)dst_ptr + j);
+        const int bound = min_raw - MAX_RESPONSE * (num_valid - done);
+        if (bound <= 0)
+            continue;
 
-            mipp::Reg<uint8_t> res_v = src_v + dst_v;
-            res_v.store((uint8_t*)dst_ptr + j);
+        size_t kept = 0;
+        for (size_t k = 0; k < blocks.size(); ++k)
+        {
+            bool alive = false;
+            if (wide)
+            {
+                mipp::Reg<int32_t> bound_v(int32_t(bound - 1));
+                for (int lane = 0; lane < B && !alive; lane += mipp::N<int32_t>())
+                    alive = !(mipp::Reg<int32_t>(&total[k * B + lane]) > bound_v).testz();
+            }
+            else
+            {
+                mipp::Reg<int16_t> bound_v(int16_t(bound - 1));
+                alive = !(mipp::Reg<int16_t>(&acc[k * B]) > bound_v).testz();
+            }
+            if (!alive)
+                continue;
+            if (kept != k)
+            {
+                blocks[kept] = blocks[k];
+                std::copy(&acc[k * B], &acc[k * B] + B, &acc[kept * B]);
+                if (wide)
+                    std::copy(&total[k * B], &total[k * B] + B, &total[kept * B]);
+            }
+            ++kept;
         }
+        blocks.resize(kept);
+    }
 
-        for(; j<template_positions; j++)
-            dst_ptr[j] += lm_ptr[j];
+    for (size_t k = 0; k < blocks.size(); ++k)
+    {
+        const int lanes = std::min(B, template_positions - blocks[k]);
+        if (wide)
+            collectAbove(&total[k * B], lanes, min_raw, blocks[k], positions, scores);
+        else
+            collectAbove(&acc[k * B], lanes, min_raw, blocks[k], positions, scores);
     }
 }
 
+template <int S>
 static void similarityLocal_64(const std::vector<Mat> &linear_memories, const Template &templ,
                                Mat &dst, Size size, int T, Point center)
 {
-    // Similar to whole-image similarity() above. This version takes a position 'center'
-    // and computes the energy in the 16x16 patch centered on it.
+    // Similar to whole-image similarityBlock() above. This version takes a position 'center'
+    // and computes the energy in the S x S patch centered on it.
     CV_Assert(templ.features.size() < 64);
 
-    // Compute the similarity map in a 16x16 patch around center
+    // Compute the similarity map in a S x S patch around center
     int W = size.width / T;
-    dst = Mat::zeros(16, 16, CV_8U);
+    dst = Mat::zeros(S, S, CV_8U);
+    uint8_t *dst_ptr = dst.ptr<uint8_t>();
 
-    // Offset each feature point by the requested center. Further adjust to (-8,-8) from the
-    // center to get the top-left corner of the 16x16 patch.
+    // Offset each feature point by the requested center. Further adjust to (-S/2,-S/2) from
+    // the center to get the top-left corner of the S x S patch.
     // NOTE: We make the offsets multiples of T to agree with results of the original code.
-    int offset_x = (center.x / T - 8) * T;
-    int offset_y = (center.y / T - 8) * T;
-
-    for (int i = 0; i < (int)templ.features.size(); ++i)
+    int offset_x = (center.x / T - S / 2) * T;
+    int offset_y = (center.y / T - S / 2) * T;
+
+    // Same register-resident window as similarityLocal(), 8 bit sums need no widening
+    const int N = mipp::N<uint8_t>();
+    const int REGS = (S * S + N - 1) / N;
+    const bool in_registers = windowInRegisters(S, N);
+    mipp::Msk<mipp::N<int32_t>()> segments[N / S + 1];
+    windowSegments<S, N>(segments);
+    mipp::Reg<uint8_t> acc[REGS];
+    for (int r = 0; r < REGS; ++r)
+        acc[r] = mipp::Reg<uint8_t>(uint8_t(0));
+
+    for (int i = 0; i < (int)templ.linear_features.size(); ++i)
     {
-        Feature f = templ.features[i];
-        f.x += offset_x;
-        f.y += offset_y;
+        const Template::LinearFeature &f = templ.linear_features[i];
+        int x = f.x + offset_x;
+        int y = f.y + offset_y;
         // Discard feature if out of bounds, possibly due to applying the offset
-        if (f.x < 0 || f.y < 0 || f.x >= size.width || f.y >= size.height)
+        if (x < 0 || y < 0 || x >= size.width || y >= size.height)
             continue;
 
-        const uchar *lm_ptr = accessLinearMemory(linear_memories, f, T, W);
-
+        const uchar *lm_ptr = accessLinearMemory(linear_memories, f, W, offset_x / T, offset_y / T);
+        if (in_registers)
         {
-            uchar *dst_ptr = dst.ptr<uchar>();
-
-            if(mipp::N<uint8_t>() > 16){ // 256 or 512 bits SIMD
-                for (int row = 0; row < 16; row += mipp::N<uint8_t>()/16){
-                    mipp::Reg<uint8_t> dst_v((uint8_t*)dst_ptr);
+            for (int r = 0; r < REGS; ++r)
+                acc[r] += loadWindowRegister<S, N>(lm_ptr, W, r, segments);
+        }
+        else
+        {
+            for (int row = 0; row < S; ++row)
+            {
+                for (int col = 0; col < S; ++col)
+                    dst_ptr[row * S + col] += lm_ptr[row * W + col];
+            }
+        }
+    }
 
-                    // load lm_ptr, 16 bytes once
-                    uint8_t local_v[mipp::N<uint8_t>()];
-                    for(int slice=0; slice<mipp::N<uint8_t>()/16; slice++){
-                        std::copy_n(lm_ptr, 16, &local_v[16*slice]);
-                        lm_ptr += W;
-                    }
-                    mipp::Reg<uint8_t> src_v(local_v);
+    if (in_registers)
+    {
+        for (int r = 0; r < REGS; ++r)
+            acc[r].store(dst_ptr + r * N);
+    }
+}
 
-                    mipp::Reg<uint8_t> res_v = src_v + dst_v;
-                    res_v.store((uint8_t*)dst_ptr);
+/**
+ * \brief Refinement similarity in the window x window patch around center, as CV_16U or CV_32S.
+ *
+ * Picks the narrowest accumulator the template's feature count allows, window is one of
+ * the sizes Detector::setRefinementWindows() accepts.
+ */
+template <int S>
+static void similarityLocalWindow(const std::vector<Mat> &linear_memories, const Template &templ,
+                                  Mat &dst, Size size, int T, Point center)
+{
+    if (templ.features.size() < 64)
+    {
+        similarityLocal_64<S>(linear_memories, templ, dst, size, T, center);
+        dst.convertTo(dst, CV_16U);
+    }
+    else if (templ.features.size() <= MAX_INT16_FEATURES)
+    {
+        similarityLocal<S>(linear_memories, templ, dst, size, T, center);
+    }
+    else
+    {
+        similarityLocal_32<S>(linear_memories, templ, dst, size, T, center);
+    }
+}
 
-                    dst_ptr += mipp::N<uint8_t>();
-                }
-            }else{ // 128 or no SIMD
-                for (int row = 0; row < 16; ++row){
-                    for(int col=0; col<16; col+=mipp::N<uint8_t>()){
-                        mipp::Reg<uint8_t> src_v((uint8_t*)lm_ptr + col);
-                        mipp::Reg<uint8_t> dst_v((uint8_t*)dst_ptr + col);
-                        mipp::Reg<uint8_t> res_v = src_v + dst_v;
-                        res_v.store((uint8_t*)dst_ptr + col);
-                    }
-                    dst_ptr += 16;
-                    lm_ptr += W;
-                }
-            }
-        }
+static void similarityLocalWindow(const std::vector<Mat> &linear_memories, const Template &templ,
+                                  Mat &dst, Size size, int T, Point center, int window)
+{
+    switch (window)
+    {
+    case 4:
+        similarityLocalWindow<4>(linear_memories, templ, dst, size, T, center);
+        break;
+    case 8:
+        similarityLocalWindow<8>(linear_memories, templ, dst, size, T, center);
+        break;
+    case 16:
+        similarityLocalWindow<16>(linear_memories, templ, dst, size, T, center);
+        break;
+    default:
+        CV_Error(Error::StsBadArg, "refinement window must be 4, 8 or 16");
     }
 }
 
@@ -1024,12 +1739,25 @@ static void similarityLocal_64(const std::vector<Mat> &linear_memories, const Te
 *                                                             High-level Detector API                                                                    *
 \****************************************************************************************/
 
+/// 16 at every level but the coarsest, where only searchPoses() uses the window
+static std::vector<int> defaultRefinementWindows(int pyramid_levels)
+{
+    std::vector<int> windows(pyramid_levels, 16);
+    if (!windows.empty())
+        windows.back() = 4;
+    return windows;
+}
+
 Detector::Detector()
 {
     this->modality = makePtr<ColorGradient>();
     pyramid_levels = 2;
     T_at_level.push_back(4);
     T_at_level.push_back(8);
+    early_rejection = false;
+    refine_windows = defaultRefinementWindows(pyramid_levels);
+    coarse_radius = 0;
+    coarse_top_k = 0;
 }
 
 Detector::Detector(std::vector<int> T)
@@ -1037,6 +1765,10 @@ Detector::Detector(std::vector<int> T)
     this->modality = makePtr<ColorGradient>();
     pyramid_levels = T.size();
     T_at_level = T;
+    early_rejection = false;
+    refine_windows = defaultRefinementWindows(pyramid_levels);
+    coarse_radius = 0;
+    coarse_top_k = 0;
 }
 
 Detector::Detector(int num_features, std::vector<int> T, float weak_thresh, float strong_threash)
@@ -1044,60 +1776,109 @@ Detector::Detector(int num_features, std::vector<int> T, float weak_thresh, floa
     this->modality = makePtr<ColorGradient>(weak_thresh, num_features, strong_threash);
     pyramid_levels = T.size();
     T_at_level = T;
+    early_rejection = false;
+    refine_windows = defaultRefinementWindows(pyramid_levels);
+    coarse_radius = 0;
+    coarse_top_k = 0;
 }
 
 std::vector<Match> Detector::match(Mat source, float threshold,
                                    const std::vector<std::string> &class_ids, const Mat mask) const
 {
+    // Only the one-shot entry point reports timings, prepared sources are meant to be reused
     Timer timer;
-    std::vector<Match> matches;
+    Ptr<const LinearMemoryPyramid> prepared = prepare(source, mask);
+    timer.out("construct response map");
+
+    std::vector<Match> matches = match(prepared, threshold, class_ids);
+    timer.out("templ match");
+    return matches;
+}
 
-    // Initialize each ColorGradient with our sources
-    std::vector<Ptr<ColorGradientPyramid>> quantizers;
+Ptr<const Detector::LinearMemoryPyramid> Detector::prepare(const Mat source, const Mat &mask) const
+{
     CV_Assert(mask.empty() || mask.size() == source.size());
-    quantizers.push_back(modality->process(source, mask));
 
-    // pyramid level -> ColorGradient -> quantization
-    LinearMemoryPyramid lm_pyramid(pyramid_levels,
-                                   std::vector<LinearMemories>(1, LinearMemories(8)));
+    // Downsample the sources of every level up front, gradients are left for the bands below
+    std::vector<Ptr<ColorGradientPyramid>> quantizers(pyramid_levels);
+    quantizers[0] = modality->process(source, mask, false);
+    for (int l = 1; l < pyramid_levels; ++l)
+    {
+        quantizers[l] = makePtr<ColorGradientPyramid>(*quantizers[l - 1]);
+        quantizers[l]->pyrDown(false);
+    }
 
-    // For each pyramid level, precompute linear memories for each ColorGradient
-    std::vector<Size> sizes;
+    // Rows handled by one work item, levels are cut the same so that they overlap in one loop
+    static const int BAND_ROWS = 64;
+
+    // (level, first row, end row) for the gradient stage
+    std::vector<Vec3i> bands;
     for (int l = 0; l < pyramid_levels; ++l)
     {
-        int T = T_at_level[l];
-        std::vector<LinearMemories> &lm_level = lm_pyramid[l];
+        for (int r = 0; r < quantizers[l]->src.rows; r += BAND_ROWS)
+            bands.push_back(Vec3i(l, r, std::min(r + BAND_ROWS, quantizers[l]->src.rows)));
+    }
 
-        if (l > 0)
-        {
-            for (int i = 0; i < (int)quantizers.size(); ++i)
-                quantizers[i]->pyrDown();
-        }
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)bands.size(); ++i)
+        quantizers[bands[i][0]]->update(bands[i][1], bands[i][2]);
 
-        Mat quantized, spread_quantized;
-        std::vector<Mat> response_maps;
-        for (int i = 0; i < (int)quantizers.size(); ++i)
-        {
-            quantizers[i]->quantize(quantized);
-            spread(quantized, spread_quantized, T);
-            computeResponseMaps(spread_quantized, response_maps);
+    Ptr<LinearMemoryPyramid> prepared = makePtr<LinearMemoryPyramid>();
+    prepared->T_at_level = T_at_level;
+    prepared->weak_threshold = modality->weak_threshold;
+    prepared->blur_pyramid_levels = modality->blur_pyramid_levels;
+    prepared->pyramid_levels = pyramid_levels;
 
-            LinearMemories &memories = lm_level[i];
-            for (int j = 0; j < 8; ++j)
-                linearize(response_maps[j], memories[j], T);
-        }
+    // pyramid level -> ColorGradient -> quantization
+    prepared->levels.assign(pyramid_levels, std::vector<LinearMemories>(1, LinearMemories(8)));
 
-        sizes.push_back(quantized.size());
+    std::vector<Mat> quantized(pyramid_levels);
+#pragma omp parallel for
+    for (int l = 0; l < pyramid_levels; ++l)
+    {
+        quantizers[l]->quantize(quantized[l]);
+        allocateLinearMemories(quantized[l].size(), prepared->levels[l][0], T_at_level[l]);
     }
+    for (int l = 0; l < pyramid_levels; ++l)
+        prepared->sizes.push_back(quantized[l].size());
 
-    timer.out("construct response map");
+    // (level, first band, end band) for the linear memories, a band being T rows.
+    // Spreading reads T - 1 rows past a band, quantized is complete by now so no halo is needed.
+    bands.clear();
+    for (int l = 0; l < pyramid_levels; ++l)
+    {
+        int T = T_at_level[l];
+        int step = std::max(1, BAND_ROWS / T);
+        for (int b = 0; b < quantized[l].rows / T; b += step)
+            bands.push_back(Vec3i(l, b, std::min(b + step, quantized[l].rows / T)));
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)bands.size(); ++i)
+    {
+        int l = bands[i][0];
+        computeLinearMemories(quantized[l], prepared->levels[l][0], T_at_level[l], bands[i][1], bands[i][2]);
+    }
 
+    return prepared;
+}
+
+std::vector<Match> Detector::match(const Ptr<const LinearMemoryPyramid> &prepared, float threshold,
+                                   const std::vector<std::string> &class_ids) const
+{
+    // Linear memories are only valid for the T and quantization they were built with
+    CV_Assert(!prepared.empty() && prepared->T_at_level == T_at_level);
+    CV_Assert(prepared->weak_threshold == modality->weak_threshold &&
+              prepared->blur_pyramid_levels == modality->blur_pyramid_levels &&
+              prepared->pyramid_levels == pyramid_levels);
+
+    std::vector<TemplatesMap::const_iterator> classes;
     if (class_ids.empty())
     {
         // Match all templates
         TemplatesMap::const_iterator it = class_templates.begin(), itend = class_templates.end();
         for (; it != itend; ++it)
-            matchClass(lm_pyramid, sizes, threshold, matches, it->first, it->second);
+            classes.push_back(it);
     }
     else
     {
@@ -1106,170 +1887,415 @@ std::vector<Match> Detector::match(Mat source, float threshold,
         {
             TemplatesMap::const_iterator it = class_templates.find(class_ids[i]);
             if (it != class_templates.end())
-                matchClass(lm_pyramid, sizes, threshold, matches, it->first, it->second);
+                classes.push_back(it);
         }
     }
+    // All classes go through one sweep, so many small classes still keep every thread busy
+    MatchArenas arenas;
+    matchClass(*prepared, threshold, arenas, classes);
+
+    // Merge the per-thread arenas once
+    size_t num_matches = 0;
+    for (size_t i = 0; i < arenas.size(); ++i)
+        num_matches += arenas[i].size();
+    std::vector<Match> matches;
+    matches.reserve(num_matches);
+    for (size_t i = 0; i < arenas.size(); ++i)
+        matches.insert(matches.end(), arenas[i].begin(), arenas[i].end());
 
     // Sort matches by similarity, and prune any duplicates introduced by pyramid refinement
     std::sort(matches.begin(), matches.end());
     std::vector<Match>::iterator new_end = std::unique(matches.begin(), matches.end());
     matches.erase(new_end, matches.end());
 
-    timer.out("templ match");
-
     return matches;
 }
 
-// Used to filter out weak matches
-struct MatchPredicate
+/// Smallest raw score whose similarity (raw * 100 / (4 * num_features)) is above threshold
+static int minRawScore(float threshold, int num_features)
 {
-    MatchPredicate(float _threshold) : threshold(_threshold) {}
-    bool operator()(const Match &m) { return m.similarity < threshold; }
-    float threshold;
-};
+    int raw = std::max(0, cvFloor(threshold * 4 * num_features / 100.f));
+    while (raw > 0 && ((raw - 1) * 100.f) / (4 * num_features) > threshold)
+        --raw;
+    while ((raw * 100.f) / (4 * num_features) <= threshold)
+        ++raw;
+    return raw;
+}
 
-void Detector::matchClass(const LinearMemoryPyramid &lm_pyramid,
-                          const std::vector<Size> &sizes,
-                          float threshold, std::vector<Match> &matches,
-                          const std::string &class_id,
-                          const std::vector<TemplatePyramid> &template_pyramids) const
+/**
+ * \brief Keep the coarse positions that are local maxima within radius, then the top_k best.
+ *
+ * radius = 0 keeps every position, top_k = 0 keeps every local maximum. positions are
+ * ascending indices into a map with rows of W positions, as returned by similarityBlock()
+ * and similarityBounded(). Positions not listed are below threshold and cannot suppress
+ * anything, so the sparse list is enough. Order is preserved.
+ */
+static void suppressCoarse(std::vector<int> &positions, std::vector<int> &scores,
+                           int W, int radius, int top_k)
 {
-#pragma omp declare reduction \
-    (omp_insert: std::vector<Match>: omp_out.insert(omp_out.end(), omp_in.begin(), omp_in.end()))
-
-#pragma omp parallel for reduction(omp_insert:matches)
-    for (size_t template_id = 0; template_id < template_pyramids.size(); ++template_id)
+    std::vector<int> kept;
+    for (size_t p = 0; p < positions.size(); ++p)
     {
-        const TemplatePyramid &tp = template_pyramids[template_id];
-        // First match over the whole image at the lowest pyramid level
-        /// @todo Factor this out into separate function
-        const std::vector<LinearMemories> &lowest_lm = lm_pyramid.back();
-
-        std::vector<Match> candidates;
+        if (radius == 0)
         {
-            // Compute similarity maps for each ColorGradient at lowest pyramid level
-            Mat similarities;
-            int lowest_start = static_cast<int>(tp.size() - 1);
-            int lowest_T = T_at_level.back();
-            int num_features = 0;
-
+            kept.push_back(static_cast<int>(p));
+            continue;
+        }
+        const int x = positions[p] % W;
+        bool maximum = true;
+        for (int dy = -radius; dy <= radius && maximum; ++dy)
+        {
+            // Neighbors on row dy are a contiguous run of the sorted positions
+            const int row = positions[p] + dy * W;
+            std::vector<int>::const_iterator it =
+                std::lower_bound(positions.begin(), positions.end(), row - std::min(radius, x));
+            const int last = row + std::min(radius, W - 1 - x);
+            for (; it != positions.end() && *it <= last; ++it)
             {
-                const Template &templ = tp[lowest_start];
-                num_features += static_cast<int>(templ.features.size());
-
-                if (templ.features.size() < 64){
-                    similarity_64(lowest_lm[0], templ, similarities, sizes.back(), lowest_T);
-                    similarities.convertTo(similarities, CV_16U);
-                }else if (templ.features.size() < 8192){
-                    similarity(lowest_lm[0], templ, similarities, sizes.back(), lowest_T);
-                }else{
-                    CV_Error(Error::StsBadArg, "feature size too large");
+                const size_t q = it - positions.begin();
+                if (scores[q] > scores[p] || (scores[q] == scores[p] && q < p))
+                {
+                    maximum = false;
+                    break;
                 }
             }
+        }
+        if (maximum)
+            kept.push_back(static_cast<int>(p));
+    }
 
-            // Find initial matches
-            for (int r = 0; r < similarities.rows; ++r)
-            {
-                ushort *row = similarities.ptr<ushort>(r);
-                for (int c = 0; c < similarities.cols; ++c)
-                {
-                    int raw_score = row[c];
-                    float score = (raw_score * 100.f) / (4 * num_features);
+    if (top_k > 0 && (int)kept.size() > top_k)
+    {
+        // Best scores first, ties by position
+        std::vector<std::pair<int, int>> ranked(kept.size());
+        for (size_t k = 0; k < kept.size(); ++k)
+            ranked[k] = std::make_pair(-scores[kept[k]], kept[k]);
+        std::nth_element(ranked.begin(), ranked.begin() + top_k, ranked.end());
+        kept.resize(top_k);
+        for (int k = 0; k < top_k; ++k)
+            kept[k] = ranked[k].second;
+        std::sort(kept.begin(), kept.end());
+    }
 
-                    if (score > threshold)
-                    {
-                        int offset = lowest_T / 2 + (lowest_T % 2 - 1);
-                        int x = c * lowest_T + offset;
-                        int y = r * lowest_T + offset;
-                        candidates.push_back(Match(x, y, score, class_id, static_cast<int>(template_id)));
-                    }
-                }
+    for (size_t k = 0; k < kept.size(); ++k)
+    {
+        positions[k] = positions[kept[k]];
+        scores[k] = scores[kept[k]];
+    }
+    positions.resize(kept.size());
+    scores.resize(kept.size());
+}
+
+/**
+ * \brief Move (x, y) to the best position of templ among the window x window positions of
+ * this level around it, returns the similarity there.
+ *
+ * (x, y) is first clamped so that the window and the template stay inside the image.
+ */
+static float searchWindow(const std::vector<Mat> &linear_memories, const Template &templ,
+                          Size size, int T, int window, int &x, int &y, Mat &similarities)
+{
+    // Window of (2 * half) x (2 * half) reduced positions around the match
+    const int half = window / 2;
+    int border = half * T;
+    int offset = T / 2 + (T % 2 - 1);
+    int max_x = size.width - templ.width - border;
+    int max_y = size.height - templ.height - border;
+
+    // Require half (reduced) row/cols to the up/left
+    x = std::max(x, border);
+    y = std::max(y, border);
+
+    // Require half (reduced) row/cols to the down/left, plus the template size
+    x = std::min(x, max_x);
+    y = std::min(y, max_y);
+
+    // Compute local similarity maps for each ColorGradient
+    int numFeatures = static_cast<int>(templ.features.size());
+    similarityLocalWindow(linear_memories, templ, similarities, size, T, Point(x, y), window);
+
+    // Find best local adjustment
+    float best_score = 0;
+    int best_r = -1, best_c = -1;
+    for (int r = 0; r < similarities.rows; ++r)
+    {
+        // CV_32S only from similarityLocal_32()
+        const ushort *row = similarities.ptr<ushort>(r);
+        const int *row_32 = similarities.ptr<int>(r);
+        const bool wide = similarities.depth() == CV_32S;
+        for (int c = 0; c < similarities.cols; ++c)
+        {
+            int score_int = wide ? row_32[c] : row[c];
+            float score = (score_int * 100.f) / (4 * numFeatures);
+
+            if (score > best_score)
+            {
+                best_score = score;
+                best_r = r;
+                best_c = c;
             }
         }
+    }
+    x = (x / T - half + best_c) * T + offset;
+    y = (y / T - half + best_r) * T + offset;
+    return best_score;
+}
 
+void Detector::matchClass(const LinearMemoryPyramid &lm_pyramid,
+                          float threshold, MatchArenas &arenas,
+                          const std::vector<TemplatesMap::const_iterator> &classes) const
+{
+    // Pose grid of each requested class, NULL to search every template
+    std::vector<const PoseGrid *> grids(classes.size(), NULL);
+    for (size_t c = 0; c < classes.size(); ++c)
+    {
+        std::map<std::string, PoseGrid>::const_iterator g = pose_grids.find(classes[c]->first);
+        if (g == pose_grids.end() || g->second.stride == 1)
+            continue;
+        CV_Assert((int)classes[c]->second.size() == g->second.num_angles * g->second.num_scales);
+        grids[c] = &g->second;
+    }
 
-        // Locally refine each match by marching up the pyramid
-        for (int l = pyramid_levels - 2; l >= 0; --l)
+    // Flatten (class, template) pairs so the scheduler spans every requested class
+    std::vector<std::pair<int, int>> work;
+    for (int c = 0; c < (int)classes.size(); ++c)
+    {
+        for (int t = 0; t < (int)classes[c]->second.size(); ++t)
         {
-            const std::vector<LinearMemories> &lms = lm_pyramid[l];
-            int T = T_at_level[l];
-            int start = static_cast<int>(l);
-            Size size = sizes[l];
-            int border = 8 * T;
-            int offset = T / 2 + (T % 2 - 1);
-            int max_x = size.width - tp[start].width - border;
-            int max_y = size.height - tp[start].height - border;
-
-            Mat similarities2;
-            for (int m = 0; m < (int)candidates.size(); ++m)
-            {
-                Match &match2 = candidates[m];
-                int x = match2.x * 2 + 1; /// @todo Support other pyramid distance
-                int y = match2.y * 2 + 1;
+            // Only the sparse poses are matched over the whole image
+            if (grids[c] && ((t % grids[c]->num_angles) % grids[c]->stride != 0 ||
+                             (t / grids[c]->num_angles) % grids[c]->stride != 0))
+                continue;
+            work.push_back(std::make_pair(c, t));
+        }
+    }
+
+    std::vector<int> class_index(classes.size());
+    for (size_t c = 0; c < classes.size(); ++c)
+        class_index[c] = classIndex(classes[c]->first);
 
-                // Require 8 (reduced) row/cols to the up/left
-                x = std::max(x, border);
-                y = std::max(y, border);
+    // Each work item owns its candidates while they are refined
+    std::vector<std::vector<Match>> candidates(work.size());
+
+#ifdef _OPENMP
+    arenas.resize(omp_get_max_threads());
+#else
+    arenas.resize(1);
+#endif
+    for (size_t i = 0; i < arenas.size(); ++i)
+        arenas[i].reserve(256);
 
-                // Require 8 (reduced) row/cols to the down/left, plus the template size
-                x = std::min(x, max_x);
-                y = std::min(y, max_y);
+    // Candidates refined by a single task, small enough to balance templates with many hits
+    const int refine_chunk = 32;
+
+    // Templates sharing one coarse task and one sweep over the lowest linear memories
+    const int template_block = 8;
+
+    // One task per block of templates for the coarse pass, which then spawns refinement tasks
+    // over chunks of each template's candidates. Idle threads pick up whatever task is pending.
+#pragma omp parallel
+#pragma omp single
+    for (int block = 0; block < (int)work.size(); block += template_block)
+    {
+#pragma omp task firstprivate(block) shared(candidates, arenas, work, classes, class_index, lm_pyramid)
+        {
+            const int block_end = std::min(block + template_block, (int)work.size());
+            // First match over the whole image at the lowest pyramid level
+            /// @todo Factor this out into separate function
+            const std::vector<LinearMemories> &lowest_lm = lm_pyramid.levels.back();
+            const int lowest_T = T_at_level.back();
+
+            // Positions of each template scoring above threshold at the lowest pyramid level
+            std::vector<int> min_raw;
+            std::vector<std::vector<int>> positions;
+            std::vector<std::vector<int>> raw_scores;
+            std::vector<const Template *> templs;
+            for (int w = block; w < block_end; ++w)
+            {
+                const Template &templ = classes[work[w].first]->second[work[w].second].back();
+                templs.push_back(&templ);
+                min_raw.push_back(minRawScore(threshold, static_cast<int>(templ.features.size())));
+            }
 
-                // Compute local similarity maps for each ColorGradient
-                int numFeatures = 0;
+            if (early_rejection)
+            {
+                positions.resize(templs.size());
+                raw_scores.resize(templs.size());
+                for (size_t k = 0; k < templs.size(); ++k)
+                    similarityBounded(lowest_lm[0], *templs[k], lm_pyramid.sizes.back(), lowest_T,
+                                      min_raw[k], positions[k], raw_scores[k]);
+            }
+            else
+            {
+                similarityBlock(lowest_lm[0], templs, min_raw, positions, raw_scores,
+                                lm_pyramid.sizes.back(), lowest_T);
+            }
 
+            for (int w = block; w < block_end; ++w)
+            {
+                const int template_id = work[w].second;
+                const int k = w - block;
+                int num_features = static_cast<int>(templs[k]->features.size());
+                int offset = lowest_T / 2 + (lowest_T % 2 - 1);
+                const int W = lm_pyramid.sizes.back().width / lowest_T;
+
+                // Neighboring cells around an object would all be refined to the same match
+                if (coarse_radius > 0 || coarse_top_k > 0)
+                    suppressCoarse(positions[k], raw_scores[k], W, coarse_radius, coarse_top_k);
+
+                // Find initial matches
+                for (size_t p = 0; p < positions[k].size(); ++p)
                 {
-                    const Template &templ = tp[start];
-                    numFeatures += static_cast<int>(templ.features.size());
-
-                    if (templ.features.size() < 64){
-                        similarityLocal_64(lms[0], templ, similarities2, size, T, Point(x, y));
-                        similarities2.convertTo(similarities2, CV_16U);
-                    }else if (templ.features.size() < 8192){
-                        similarityLocal(lms[0], templ, similarities2, size, T, Point(x, y));
-                    }else{
-                        CV_Error(Error::StsBadArg, "feature size too large");
+                    float score = (raw_scores[k][p] * 100.f) / (4 * num_features);
+                    if (score > threshold)
+                    {
+                        int x = positions[k][p] % W * lowest_T + offset;
+                        int y = positions[k][p] / W * lowest_T + offset;
+                        candidates[w].push_back(Match(x, y, score, class_index[work[w].first], template_id));
                     }
                 }
 
-                // Find best local adjustment
-                float best_score = 0;
-                int best_r = -1, best_c = -1;
-                for (int r = 0; r < similarities2.rows; ++r)
+                for (int begin = 0; begin < (int)candidates[w].size(); begin += refine_chunk)
                 {
-                    ushort *row = similarities2.ptr<ushort>(r);
-                    for (int c = 0; c < similarities2.cols; ++c)
+#pragma omp task firstprivate(w, begin) shared(candidates, arenas, work, classes, grids, lm_pyramid)
                     {
-                        int score_int = row[c];
-                        float score = (score_int * 100.f) / (4 * numFeatures);
+                        const std::vector<TemplatePyramid> &pyramids = classes[work[w].first]->second;
+                        const PoseGrid *grid = grids[work[w].first];
+                        const int end = std::min(begin + refine_chunk, (int)candidates[w].size());
 
-                        if (score > best_score)
+                        // Locally refine each match by marching up the pyramid
+                        Mat similarities2;
+                        for (int m = begin; m < end; ++m)
+                        {
+                            Match &match2 = candidates[w][m];
+                            if (grid)
+                                searchPoses(lm_pyramid, pyramids, *grid, match2, similarities2);
+                            const TemplatePyramid &tp = pyramids[match2.template_id];
+                            for (int l = pyramid_levels - 2; l >= 0; --l)
+                            {
+                                const std::vector<LinearMemories> &lms = lm_pyramid.levels[l];
+                                int x = match2.x * 2 + 1; /// @todo Support other pyramid distance
+                                int y = match2.y * 2 + 1;
+                                float score = searchWindow(lms[0], tp[l], lm_pyramid.sizes[l], T_at_level[l],
+                                                           refine_windows[l], x, y, similarities2);
+
+                                // Update current match
+                                match2.similarity = score;
+                                match2.x = x;
+                                match2.y = y;
+
+                                // A match below the similarity threshold is dropped, no need to refine further
+                                if (match2.similarity < threshold)
+                                    break;
+                            }
+                        }
+
+                        // Only the running thread touches its arena, no locking needed
+#ifdef _OPENMP
+                        std::vector<Match> &arena = arenas[omp_get_thread_num()];
+#else
+                        std::vector<Match> &arena = arenas[0];
+#endif
+                        for (int m = begin; m < end; ++m)
                         {
-                            best_score = score;
-                            best_r = r;
-                            best_c = c;
+                            if (candidates[w][m].similarity >= threshold)
+                                arena.push_back(candidates[w][m]);
                         }
                     }
                 }
-                // Update current match
-                match2.similarity = best_score;
-                match2.x = (x / T - 8 + best_c) * T + offset;
-                match2.y = (y / T - 8 + best_r) * T + offset;
             }
-
-            // Filter out any matches that drop below the similarity threshold
-            std::vector<Match>::iterator new_end = std::remove_if(candidates.begin(), candidates.end(),
-                                                                  MatchPredicate(threshold));
-            candidates.erase(new_end, candidates.end());
         }
+    }
+}
 
-        matches.insert(matches.end(), candidates.begin(), candidates.end());
+void Detector::setRefinementWindows(const std::vector<int> &windows)
+{
+    CV_Assert((int)windows.size() == pyramid_levels);
+    for (size_t l = 0; l < windows.size(); ++l)
+        CV_Assert(windows[l] == 4 || windows[l] == 8 || windows[l] == 16);
+    refine_windows = windows;
+}
+
+void Detector::searchPoses(const LinearMemoryPyramid &lm_pyramid, const std::vector<TemplatePyramid> &pyramids,
+                           const PoseGrid &grid, Match &match, Mat &similarities) const
+{
+    // Positions of this level around the candidate, enough to absorb the shift between poses
+    const int window = refine_windows.back();
+    const std::vector<LinearMemories> &lowest_lm = lm_pyramid.levels.back();
+    const Template &templ = pyramids[match.template_id].back();
+    const int angle = match.template_id % grid.num_angles;
+    const int scale = match.template_id / grid.num_angles;
+
+    Match best = match;
+    for (int ds = 1 - grid.stride; ds < grid.stride; ++ds)
+    {
+        const int s = scale + ds;
+        if (s < 0 || s >= grid.num_scales)
+            continue;
+        for (int da = 1 - grid.stride; da < grid.stride; ++da)
+        {
+            int a = angle + da;
+            if (grid.wrap_angles)
+                a = (a + grid.num_angles) % grid.num_angles;
+            if (a < 0 || a >= grid.num_angles || (ds == 0 && da == 0))
+                continue;
+
+            // Templates are cropped from the same source, align them on its origin
+            const int id = s * grid.num_angles + a;
+            const Template &other = pyramids[id].back();
+            int x = match.x - templ.tl_x + other.tl_x;
+            int y = match.y - templ.tl_y + other.tl_y;
+            float score = searchWindow(lowest_lm[0], other, lm_pyramid.sizes.back(), T_at_level.back(),
+                                       window, x, y, similarities);
+            if (score > best.similarity)
+                best = Match(x, y, score, match.class_index, id);
+        }
     }
+    match = best;
+}
+
+void Detector::setPoseGrid(const std::string &class_id, int num_angles, int num_scales, int stride,
+                           float angle_span)
+{
+    CV_Assert(num_angles > 0 && num_scales > 0 && stride > 0 && angle_span >= 0.f);
+    PoseGrid grid;
+    grid.num_angles = num_angles;
+    grid.num_scales = num_scales;
+    grid.stride = stride;
+    // Only a full turn has its first and last angles next to each other
+    grid.wrap_angles = angle_span >= 360.f;
+    pose_grids[class_id] = grid;
+}
+
+void Detector::setCoarseSuppression(int radius, int top_k)
+{
+    CV_Assert(radius >= 0 && top_k >= 0);
+    coarse_radius = radius;
+    coarse_top_k = top_k;
+}
+
+int Detector::internClass(const std::string &class_id)
+{
+    std::map<std::string, int>::const_iterator it = class_indices.find(class_id);
+    if (it != class_indices.end())
+        return it->second;
+
+    int class_index = static_cast<int>(class_names.size());
+    class_names.push_back(class_id);
+    class_indices[class_id] = class_index;
+    return class_index;
+}
+
+int Detector::classIndex(const std::string &class_id) const
+{
+    std::map<std::string, int>::const_iterator it = class_indices.find(class_id);
+    return it == class_indices.end() ? -1 : it->second;
 }
 
 int Detector::addTemplate(const Mat source, const std::string &class_id,
                           const Mat &object_mask, int num_features)
 {
+    internClass(class_id);
     std::vector<TemplatePyramid> &template_pyramids = class_templates[class_id];
     int template_id = static_cast<int>(template_pyramids.size());
 
@@ -1297,9 +2323,13 @@ int Detector::addTemplate(const Mat source, const std::string &class_id,
 
     //    Rect bb =
     cropTemplates(tp);
+    for (int l = 0; l < pyramid_levels; ++l)
+        tp[l].linearize(T_at_level[l]);
 
     /// @todo Can probably avoid a copy of tp here with swap
     template_pyramids.push_back(tp);
+    TemplateOrigin origin = {-1, 0.f, Point2f()};
+    class_origins[class_id].push_back(origin);
     return template_id;
 }
 
@@ -1317,14 +2347,9 @@ static cv::Point2f rotatePoint(const cv::Point2f inPoint, const cv::Point2f cent
     return rotate2d(inPoint - center, angRad) + center;
 }
 
-int Detector::addTemplate_rotate(const string &class_id, int zero_id,
-                                 float theta, cv::Point2f center)
+Detector::TemplatePyramid Detector::rotatePyramid(const TemplatePyramid &to_rotate_tp, float theta,
+                                                  cv::Point2f center) const
 {
-    std::vector<TemplatePyramid> &template_pyramids = class_templates[class_id];
-    int template_id = static_cast<int>(template_pyramids.size());
-
-    const auto& to_rotate_tp = template_pyramids[zero_id];
-
     TemplatePyramid tp;
     tp.resize(pyramid_levels);
 
@@ -1356,8 +2381,21 @@ int Detector::addTemplate_rotate(const string &class_id, int zero_id,
     }
 
     cropTemplates(tp);
+    for (int l = 0; l < pyramid_levels; ++l)
+        tp[l].linearize(T_at_level[l]);
+    return tp;
+}
 
-    template_pyramids.push_back(tp);
+int Detector::addTemplate_rotate(const string &class_id, int zero_id,
+                                 float theta, cv::Point2f center)
+{
+    internClass(class_id);
+    std::vector<TemplatePyramid> &template_pyramids = class_templates[class_id];
+    int template_id = static_cast<int>(template_pyramids.size());
+
+    template_pyramids.push_back(rotatePyramid(template_pyramids[zero_id], theta, center));
+    TemplateOrigin origin = {zero_id, theta, center};
+    class_origins[class_id].push_back(origin);
     return template_id;
 }
 const std::vector<Template> &Detector::getTemplates(const std::string &class_id, int template_id) const
@@ -1400,8 +2438,13 @@ std::vector<std::string> Detector::classIds() const
 void Detector::read(const FileNode &fn)
 {
     class_templates.clear();
+    class_origins.clear();
+    pose_grids.clear();
+    class_names.clear();
+    class_indices.clear();
     pyramid_levels = fn["pyramid_levels"];
     fn["T"] >> T_at_level;
+    refine_windows = defaultRefinementWindows(pyramid_levels);
 
     modality = makePtr<ColorGradient>();
 }
@@ -1416,30 +2459,41 @@ void Detector::write(FileStorage &fs) const
 
 std::string Detector::readClass(const FileNode &fn, const std::string &class_id_override)
 {
-    // Detector should not already have this class
     String class_id;
     if (class_id_override.empty())
     {
         String class_id_tmp = fn["class_id"];
-        CV_Assert(class_templates.find(class_id_tmp) == class_templates.end());
         class_id = class_id_tmp;
     }
     else
     {
         class_id = class_id_override;
     }
+    // Detector should not already have this class, whichever name it is loaded under
+    CV_Assert(class_templates.find(class_id) == class_templates.end());
 
     TemplatesMap::value_type v(class_id, std::vector<TemplatePyramid>());
     std::vector<TemplatePyramid> &tps = v.second;
-    int expected_id = 0;
+    std::vector<TemplateOrigin> origins;
 
+    // Compact files only list the extracted templates, see writeClass()
+    FileNode rotations_fn = fn["rotations"];
+    const bool compact = !rotations_fn.empty();
     FileNode tps_fn = fn["template_pyramids"];
-    tps.resize(tps_fn.size());
+    tps.resize(compact ? (int)fn["num_templates"] : tps_fn.size());
+    TemplateOrigin extracted = {-1, 0.f, Point2f()};
+    origins.assign(tps.size(), extracted);
+    // Every id must be listed or regenerated exactly once, or matchClass() meets empty pyramids
+    std::vector<uchar> filled(tps.size(), 0);
+
+    int expected_id = 0;
     FileNodeIterator tps_it = tps_fn.begin(), tps_it_end = tps_fn.end();
     for (; tps_it != tps_it_end; ++tps_it, ++expected_id)
     {
         int template_id = (*tps_it)["template_id"];
-        CV_Assert(template_id == expected_id);
+        CV_Assert(template_id >= 0 && template_id < (int)tps.size() && !filled[template_id]);
+        CV_Assert(compact || template_id == expected_id);
+        filled[template_id] = 1;
         FileNode templates_fn = (*tps_it)["templates"];
         tps[template_id].resize(templates_fn.size());
 
@@ -1447,26 +2501,101 @@ std::string Detector::readClass(const FileNode &fn, const std::string &class_id_
         int idx = 0;
         for (; templ_it != templ_it_end; ++templ_it)
         {
-            tps[template_id][idx++].read(*templ_it);
+            Template &templ = tps[template_id][idx++];
+            templ.read(*templ_it);
+            CV_Assert(templ.pyramid_level >= 0 && templ.pyramid_level < (int)T_at_level.size());
+            templ.linearize(T_at_level[templ.pyramid_level]);
+        }
+    }
+
+    if (compact)
+    {
+        // Each run covers count consecutive ids, angles accumulate exactly as when written
+        std::vector<int> derived;
+        FileNodeIterator run_it = rotations_fn.begin(), run_it_end = rotations_fn.end();
+        for (; run_it != run_it_end; ++run_it)
+        {
+            const FileNode &run = *run_it;
+            int first = run["first_id"], count = run["count"];
+            float theta = run["theta"], step = run["step"];
+            TemplateOrigin origin = {(int)run["base"], theta, Point2f((float)run["center_x"], (float)run["center_y"])};
+            CV_Assert(first >= 0 && count >= 0 && first + count <= (int)tps.size());
+            for (int k = 0; k < count; ++k)
+            {
+                CV_Assert(origin.base >= 0 && origin.base < first + k && !filled[first + k]);
+                filled[first + k] = 1;
+                origins[first + k] = origin;
+                derived.push_back(first + k);
+                origin.theta += step;
+            }
+        }
+
+        // Bases must all be there before anything is rotated
+        for (size_t i = 0; i < filled.size(); ++i)
+            CV_Assert(filled[i]);
+
+        // Templates derived from derived ones wait for their base, every round runs in parallel
+        std::vector<uchar> ready(tps.size(), 1);
+        for (size_t i = 0; i < derived.size(); ++i)
+            ready[derived[i]] = 0;
+        // rotatePyramid() reads every level of a base
+        for (size_t i = 0; i < ready.size(); ++i)
+            CV_Assert(!ready[i] || (int)tps[i].size() == pyramid_levels);
+        while (!derived.empty())
+        {
+            std::vector<int> round, later;
+            for (size_t i = 0; i < derived.size(); ++i)
+                (ready[origins[derived[i]].base] ? round : later).push_back(derived[i]);
+            CV_Assert(!round.empty());
+
+#pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < (int)round.size(); ++i)
+            {
+                const TemplateOrigin &origin = origins[round[i]];
+                tps[round[i]] = rotatePyramid(tps[origin.base], origin.theta, origin.center);
+            }
+            for (size_t i = 0; i < round.size(); ++i)
+                ready[round[i]] = 1;
+            derived.swap(later);
         }
     }
 
-    class_templates.insert(v);
+    for (size_t i = 0; i < filled.size(); ++i)
+        CV_Assert(filled[i] && !tps[i].empty());
+
+    // Origins must describe the templates actually stored, so only a new class takes them
+    if (class_templates.insert(v).second)
+        class_origins[class_id] = origins;
+    internClass(class_id);
     return class_id;
 }
 
-void Detector::writeClass(const std::string &class_id, FileStorage &fs) const
+void Detector::writeClass(const std::string &class_id, FileStorage &fs, bool compact) const
 {
     TemplatesMap::const_iterator it = class_templates.find(class_id);
     CV_Assert(it != class_templates.end());
     const std::vector<TemplatePyramid> &tps = it->second;
 
+    // Nothing to save without rotated templates, keep the plain format then
+    std::map<std::string, std::vector<TemplateOrigin>>::const_iterator origins_it = class_origins.find(class_id);
+    bool any_rotated = false;
+    if (origins_it != class_origins.end() && origins_it->second.size() == tps.size())
+    {
+        for (size_t i = 0; i < tps.size(); ++i)
+            any_rotated = any_rotated || origins_it->second[i].base >= 0;
+    }
+    compact = compact && any_rotated;
+
     fs << "class_id" << it->first;
     fs << "pyramid_levels" << pyramid_levels;
+    if (compact)
+        fs << "num_templates" << int(tps.size());
     fs << "template_pyramids"
        << "[";
     for (size_t i = 0; i < tps.size(); ++i)
     {
+        if (compact && origins_it->second[i].base >= 0)
+            continue;
         const TemplatePyramid &tp = tps[i];
         fs << "{";
         fs << "template_id" << int(i); //TODO is this cast correct? won't be good if rolls over...
@@ -1482,6 +2611,48 @@ void Detector::writeClass(const std::string &class_id, FileStorage &fs) const
         fs << "}"; // current pyramid
     }
     fs << "]"; // pyramids
+
+    if (!compact)
+        return;
+
+    // Consecutive rotations of one base about one center, with a constant angle step, share a run
+    const std::vector<TemplateOrigin> &origins = origins_it->second;
+    fs << "rotations"
+       << "[";
+    for (int i = 0; i < (int)tps.size();)
+    {
+        const TemplateOrigin &first = origins[i];
+        if (first.base < 0)
+        {
+            ++i;
+            continue;
+        }
+        float step = 0.f;
+        int count = 1;
+        if (i + 1 < (int)tps.size())
+            step = origins[i + 1].theta - first.theta;
+        float theta = first.theta;
+        while (i + count < (int)tps.size())
+        {
+            const TemplateOrigin &next = origins[i + count];
+            // Same float accumulation as readClass(), so every angle comes back bit-exact
+            if (next.base != first.base || next.center != first.center || next.theta != theta + step)
+                break;
+            theta += step;
+            ++count;
+        }
+        fs << "{";
+        fs << "first_id" << i;
+        fs << "count" << count;
+        fs << "base" << first.base;
+        fs << "theta" << first.theta;
+        fs << "step" << step;
+        fs << "center_x" << first.center.x;
+        fs << "center_y" << first.center.y;
+        fs << "}";
+        i += count;
+    }
+    fs << "]"; // rotations
 }
 
 void Detector::readClasses(const std::vector<std::string> &class_ids,
@@ -1496,7 +2667,7 @@ void Detector::readClasses(const std::vector<std::string> &class_ids,
     }
 }
 
-void Detector::writeClasses(const std::string &format) const
+void Detector::writeClasses(const std::string &format, bool compact) const
 {
     TemplatesMap::const_iterator it = class_templates.begin(), it_end = class_templates.end();
     for (; it != it_end; ++it)
@@ -1504,8 +2675,566 @@ void Detector::writeClasses(const std::string &format) const
         const String &class_id = it->first;
         String filename = cv::format(format.c_str(), class_id.c_str());
         FileStorage fs(filename, FileStorage::WRITE);
-        writeClass(class_id, fs);
+        writeClass(class_id, fs, compact);
+    }
+}
+
+/****************************************************************************************\
+*                                                             Match suppression                                                                          *
+\****************************************************************************************/
+
+/**
+ * \brief Box around the features of templ, rotated by angle degrees counter-clockwise,
+ * relative to the template's top-left corner. Its sides follow the rotated axes.
+ */
+static RotatedRect rotatedTemplateBox(const Template &templ, float angle)
+{
+    if (templ.features.empty())
+        return RotatedRect(Point2f(templ.width / 2.f, templ.height / 2.f),
+                           Size2f(float(templ.width), float(templ.height)), 0.f);
+
+    // Object axes on screen, image y points down
+    const float rad = angle * float(CV_PI) / 180.f;
+    const Point2f u(std::cos(rad), -std::sin(rad)), v(std::sin(rad), std::cos(rad));
+    float min_u = FLT_MAX, max_u = -FLT_MAX, min_v = FLT_MAX, max_v = -FLT_MAX;
+    for (size_t i = 0; i < templ.features.size(); ++i)
+    {
+        const Point2f p(float(templ.features[i].x), float(templ.features[i].y));
+        min_u = std::min(min_u, p.dot(u));
+        max_u = std::max(max_u, p.dot(u));
+        min_v = std::min(min_v, p.dot(v));
+        max_v = std::max(max_v, p.dot(v));
+    }
+
+    Point2f center = u * ((min_u + max_u) / 2) + v * ((min_v + max_v) / 2);
+    // RotatedRect angles turn clockwise on screen
+    return RotatedRect(center, Size2f(max_u - min_u, max_v - min_v), -angle);
+}
+
+static float rotatedOverlap(const RotatedRect &a, const RotatedRect &b)
+{
+    std::vector<Point2f> corners, hull;
+    if (rotatedRectangleIntersection(a, b, corners) == INTERSECT_NONE)
+        return 0.f;
+    // Corners of the intersection are not ordered
+    convexHull(corners, hull);
+    float inter = static_cast<float>(contourArea(hull));
+    // Collinear features give empty boxes, which overlap nothing
+    float area = a.size.area() + b.size.area() - inter;
+    return area > 0.f ? inter / area : 0.f;
+}
+
+static float rectOverlap(const Rect &a, const Rect &b)
+{
+    float inter = float((a & b).area());
+    float area = a.area() + b.area() - inter;
+    return area > 0.f ? inter / area : 0.f;
+}
+
+static Point2f boxCenter(const Rect &r)
+{
+    return Point2f(r.x + r.width / 2.f, r.y + r.height / 2.f);
+}
+
+static Point2f boxCenter(const RotatedRect &r)
+{
+    return r.center;
+}
+
+/// Overlapping boxes have centers closer than this
+static float boxReach(const Rect &r)
+{
+    return float(std::max(r.width, r.height));
+}
+
+static float boxReach(const RotatedRect &r)
+{
+    return std::sqrt(r.size.width * r.size.width + r.size.height * r.size.height);
+}
+
+static float boxOverlap(const Rect &a, const Rect &b)
+{
+    return rectOverlap(a, b);
+}
+
+static float boxOverlap(const RotatedRect &a, const RotatedRect &b)
+{
+    return rotatedOverlap(a, b);
+}
+
+/**
+ * \brief Greedy non-maximum suppression of boxes, returns the survivors by decreasing score.
+ *
+ * Boxes are visited by decreasing score, ties in input order, and one survives if its
+ * intersection over union with every survivor is at most nms_threshold. Survivors are binned
+ * on a uniform grid by center with cells as wide as the largest box, so each box is only
+ * compared to the survivors in the 3 x 3 cells around it.
+ */
+template <typename Box>
+static std::vector<int> suppressBoxes(const std::vector<Box> &boxes, const std::vector<float> &scores,
+                                      float nms_threshold)
+{
+    const int n = static_cast<int>(boxes.size());
+    std::vector<int> keep;
+    if (n == 0)
+        return keep;
+
+    // Uniform grid over the centers, a cell is as wide as the reach
+    float reach = 1.f;
+    float min_x = FLT_MAX, min_y = FLT_MAX, max_x = -FLT_MAX, max_y = -FLT_MAX;
+    for (int i = 0; i < n; ++i)
+    {
+        const Point2f c = boxCenter(boxes[i]);
+        reach = std::max(reach, boxReach(boxes[i]));
+        min_x = std::min(min_x, c.x);
+        min_y = std::min(min_y, c.y);
+        max_x = std::max(max_x, c.x);
+        max_y = std::max(max_y, c.y);
+    }
+    const int cols = int((max_x - min_x) / reach) + 1;
+    const int rows = int((max_y - min_y) / reach) + 1;
+    std::vector<std::vector<int>> cells(cols * rows);
+
+    std::vector<int> order(n);
+    for (int i = 0; i < n; ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&scores](int a, int b) { return scores[a] > scores[b]; });
+
+    for (int i : order)
+    {
+        const Point2f c = boxCenter(boxes[i]);
+        const int cx = int((c.x - min_x) / reach);
+        const int cy = int((c.y - min_y) / reach);
+        bool suppressed = false;
+        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, rows - 1) && !suppressed; ++y)
+        {
+            for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, cols - 1) && !suppressed; ++x)
+            {
+                for (int k : cells[y * cols + x])
+                {
+                    if (boxOverlap(boxes[i], boxes[k]) > nms_threshold)
+                    {
+                        suppressed = true;
+                        break;
+                    }
+                }
+            }
+        }
+        if (suppressed)
+            continue;
+        keep.push_back(i);
+        cells[cy * cols + cx].push_back(i);
+    }
+    return keep;
+}
+
+std::vector<int> Detector::suppressMatches(const std::vector<Match> &matches, float nms_threshold,
+                                           const std::vector<float> &angles) const
+{
+    const bool rotated = !angles.empty();
+    CV_Assert(!rotated || angles.size() == matches.size());
+    const int n = static_cast<int>(matches.size());
+
+    // Templates of each interned class, looked up once
+    std::vector<const std::vector<TemplatePyramid> *> class_pyramids(class_names.size(), NULL);
+    std::vector<Rect> rects(rotated ? 0 : n);
+    std::vector<RotatedRect> boxes(rotated ? n : 0);
+    std::vector<float> scores(n);
+    for (int i = 0; i < n; ++i)
+    {
+        const Match &m = matches[i];
+        if (!class_pyramids[m.class_index])
+            class_pyramids[m.class_index] = &class_templates.find(class_names[m.class_index])->second;
+        const Template &templ = (*class_pyramids[m.class_index])[m.template_id][0];
+        scores[i] = m.similarity;
+
+        if (rotated)
+        {
+            boxes[i] = rotatedTemplateBox(templ, angles[i]);
+            boxes[i].center += Point2f(float(m.x), float(m.y));
+        }
+        else
+        {
+            rects[i] = Rect(m.x, m.y, templ.width, templ.height);
+        }
+    }
+    return rotated ? suppressBoxes(boxes, scores, nms_threshold) : suppressBoxes(rects, scores, nms_threshold);
+}
+
+/****************************************************************************************\
+*                                                             Pose refinement                                                                            *
+\****************************************************************************************/
+
+/**
+ * \brief Strongest edge of dx, dy along normal from p, within radius pixels and 30 degrees of
+ * normal either way, with sub-pixel position. Returns false if none clears min_magnitude_sq.
+ *
+ * Gradients are interpolated bilinearly at p + k * normal, so samples sit exactly one pixel
+ * apart along the normal whatever the fractional part of p.
+ *
+ * \param strength Scratch space for 2 * radius + 1 values.
+ * \param[out] edge_normal Unit gradient of the image at the edge.
+ */
+static bool findEdge(const Mat &dx, const Mat &dy, Point2f p, Point2f normal,
+                     int radius, int min_magnitude_sq, float *strength, Point2f &edge, Point2f &edge_normal)
+{
+    static const float COS_TOLERANCE = 0.866f;
+    int best_k = 0;
+    float best = 0.f;
+    Point2f best_gradient;
+    for (int k = -radius; k <= radius; ++k)
+    {
+        strength[k + radius] = 0.f;
+        const Point2f q = p + normal * float(k);
+        const int x = cvFloor(q.x), y = cvFloor(q.y);
+        if (x < 0 || y < 0 || x + 1 >= dx.cols || y + 1 >= dx.rows)
+            continue;
+        const float fx = q.x - x, fy = q.y - y;
+        const float w00 = (1 - fx) * (1 - fy), w01 = fx * (1 - fy), w10 = (1 - fx) * fy, w11 = fx * fy;
+        const short *dx0 = dx.ptr<short>(y) + x, *dx1 = dx.ptr<short>(y + 1) + x;
+        const short *dy0 = dy.ptr<short>(y) + x, *dy1 = dy.ptr<short>(y + 1) + x;
+        const Point2f g(w00 * dx0[0] + w01 * dx0[1] + w10 * dx1[0] + w11 * dx1[1],
+                        w00 * dy0[0] + w01 * dy0[1] + w10 * dy1[0] + w11 * dy1[1]);
+        const float mag_sq = g.dot(g);
+        if (mag_sq < float(min_magnitude_sq))
+            continue;
+        const float mag = std::sqrt(mag_sq);
+        // Either polarity, the object may sit on a brighter or darker background
+        if (std::abs(g.dot(normal)) < COS_TOLERANCE * mag)
+            continue;
+        strength[k + radius] = mag;
+        if (mag > best)
+        {
+            best = mag;
+            best_k = k;
+            best_gradient = g;
+        }
+    }
+    if (best == 0.f)
+        return false;
+
+    // Parabola through the neighbors along the normal
+    float offset = 0.f;
+    if (best_k > -radius && best_k < radius)
+    {
+        const float l = strength[best_k + radius - 1], r = strength[best_k + radius + 1];
+        const float curvature = l - 2 * best + r;
+        if (l > 0.f && r > 0.f && curvature < 0.f)
+            offset = 0.5f * (l - r) / curvature;
+    }
+    edge = p + normal * (best_k + offset);
+    edge_normal = best_gradient * (1.f / best);
+    return true;
+}
+
+/**
+ * \brief Fit a similarity transform of the features of templ at match to the edges of dx, dy.
+ *
+ * Features are p = c + scale * R(angle) (p0 - c) + t, c the centroid of the matched features
+ * p0. Each round pairs every feature with an edge along its rotated gradient, then solves the
+ * linearized point-to-line least squares for small updates of t, angle and scale. The pose
+ * returned is paired once more, so error and inliers describe it and not the round before.
+ */
+static RefinedPose fitPose(const Mat &dx, const Mat &dy, const Template &templ,
+                           const Match &match, int iterations, float search_radius, int min_magnitude_sq)
+{
+    const int n = static_cast<int>(templ.features.size());
+    std::vector<Point2f> p0(n);
+    Point2f c(0.f, 0.f);
+    for (int i = 0; i < n; ++i)
+    {
+        p0[i] = Point2f(float(match.x + templ.features[i].x), float(match.y + templ.features[i].y));
+        c += p0[i];
+    }
+    c = c * (1.f / std::max(n, 1));
+
+    RefinedPose pose;
+    pose.center = c;
+    pose.angle = 0.f;
+    pose.scale = 1.f;
+    pose.error = 0.f;
+    pose.inliers = 0;
+    const int radius = cvCeil(search_radius);
+    std::vector<float> strength(2 * radius + 1);
+
+    Point2f t(0.f, 0.f);
+    double angle = 0.0, scale = 1.0;
+    bool converged = false;
+    for (int it = 0; it <= iterations; ++it)
+    {
+        // Counter-clockwise on screen, image y points down
+        const double cos_a = std::cos(angle), sin_a = std::sin(angle);
+        Mat A = Mat::zeros(4, 4, CV_64F), b = Mat::zeros(4, 1, CV_64F);
+        double sum_sq = 0.0;
+        int inliers = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const Point2f d = p0[i] - c;
+            const Point2f v(float(scale * (cos_a * d.x + sin_a * d.y)), float(scale * (-sin_a * d.x + cos_a * d.y)));
+            const Point2f p = c + t + v;
+            const float theta = (templ.features[i].theta * float(CV_PI) / 180.f) - float(angle);
+            Point2f edge, normal;
+            if (!findEdge(dx, dy, p, Point2f(std::cos(theta), std::sin(theta)), radius,
+                          min_magnitude_sq, strength.data(), edge, normal))
+                continue;
+
+            // Derivatives of normal . p with respect to t, angle and scale
+            const double row[4] = {normal.x, normal.y, normal.x * v.y - normal.y * v.x, normal.dot(v)};
+            const double r = normal.dot(edge - p);
+            for (int j = 0; j < 4; ++j)
+            {
+                for (int k = 0; k < 4; ++k)
+                    A.at<double>(j, k) += row[j] * row[k];
+                b.at<double>(j, 0) += row[j] * r;
+            }
+            sum_sq += r * r;
+            ++inliers;
+        }
+
+        pose.inliers = inliers;
+        pose.error = inliers ? float(std::sqrt(sum_sq / inliers)) : 0.f;
+        Mat update;
+        if (converged || it == iterations || inliers < 4 || !solve(A, b, update, DECOMP_CHOLESKY))
+            break;
+
+        t += Point2f(float(update.at<double>(0, 0)), float(update.at<double>(1, 0)));
+        angle += update.at<double>(2, 0);
+        scale *= 1.0 + update.at<double>(3, 0);
+
+        // Converged to well below a pixel at the template's extent, pair the final pose once more
+        converged = std::abs(update.at<double>(0, 0)) + std::abs(update.at<double>(1, 0)) < 1e-3 &&
+                    std::abs(update.at<double>(2, 0)) + std::abs(update.at<double>(3, 0)) < 1e-5;
+    }
+
+    pose.center = c + t;
+    pose.angle = float(angle * 180.0 / CV_PI);
+    pose.scale = float(scale);
+    return pose;
+}
+
+std::vector<RefinedPose> Detector::refinePoses(const Mat &source, const std::vector<Match> &matches,
+                                               int iterations, float search_radius) const
+{
+    std::vector<RefinedPose> poses(matches.size());
+    if (matches.empty())
+        return poses;
+
+    // Same gradients the templates were extracted from, at full resolution
+    Ptr<ColorGradientPyramid> gradients = modality->process(source);
+    const int min_magnitude_sq = cvFloor(modality->weak_threshold * modality->weak_threshold);
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int)matches.size(); ++i)
+    {
+        const Match &match = matches[i];
+        const Template &templ = getTemplates(class_names[match.class_index], match.template_id)[0];
+        poses[i] = fitPose(gradients->dx, gradients->dy, templ, match,
+                           iterations, search_radius, min_magnitude_sq);
+    }
+    return poses;
+}
+
+/****************************************************************************************\
+*                                                             Ensemble Detector                                                                          *
+\****************************************************************************************/
+
+/**
+ * \brief Boxes kept as separate coordinate arrays, so overlaps load straight into SIMD registers.
+ */
+struct BoxArray
+{
+    std::vector<float> x1, y1, x2, y2, area, score;
+
+    int size() const { return static_cast<int>(x1.size()); }
+
+    void push_back(const Rect &r, float s)
+    {
+        x1.push_back(float(r.x));
+        y1.push_back(float(r.y));
+        x2.push_back(float(r.x + r.width));
+        y2.push_back(float(r.y + r.height));
+        area.push_back(float(r.area()));
+        score.push_back(s);
+    }
+};
+
+/**
+ * \brief Intersection over union of box i in a against every box of b, written to iou.
+ * Boxes whose union is empty overlap nothing, as in rectOverlap().
+ */
+static void overlaps(const BoxArray &a, int i, const BoxArray &b, float *iou)
+{
+    const int n = b.size();
+    int j = 0;
+
+    const mipp::Reg<float> ax1_v(a.x1[i]), ay1_v(a.y1[i]);
+    const mipp::Reg<float> ax2_v(a.x2[i]), ay2_v(a.y2[i]);
+    const mipp::Reg<float> aarea_v(a.area[i]), zero_v(0.0f);
+    for (; j <= n - mipp::N<float>(); j += mipp::N<float>())
+    {
+        mipp::Reg<float> iw = mipp::min(ax2_v, mipp::Reg<float>(&b.x2[j])) -
+                              mipp::max(ax1_v, mipp::Reg<float>(&b.x1[j]));
+        mipp::Reg<float> ih = mipp::min(ay2_v, mipp::Reg<float>(&b.y2[j])) -
+                              mipp::max(ay1_v, mipp::Reg<float>(&b.y1[j]));
+        mipp::Reg<float> inter = mipp::max(iw, zero_v) * mipp::max(ih, zero_v);
+        mipp::Reg<float> area = aarea_v + mipp::Reg<float>(&b.area[j]) - inter;
+        mipp::Reg<float> res = mipp::blend(inter / area, zero_v, area > zero_v);
+        res.store(iou + j);
+    }
+    for (; j < n; ++j)
+    {
+        float iw = std::max(std::min(a.x2[i], b.x2[j]) - std::max(a.x1[i], b.x1[j]), 0.0f);
+        float ih = std::max(std::min(a.y2[i], b.y2[j]) - std::max(a.y1[i], b.y1[j]), 0.0f);
+        float inter = iw * ih;
+        float area = a.area[i] + b.area[j] - inter;
+        iou[j] = area > 0.f ? inter / area : 0.f;
+    }
+}
+
+EnsembleDetector::EnsembleDetector(int num_features, std::vector<int> T, float weak_thresh, float strong_thresh)
+    : detector(num_features, T, weak_thresh, strong_thresh)
+{
+}
+
+int EnsembleDetector::readMember(const FileNode &fn)
+{
+    int member = numMembers();
+    member_ids.push_back(detector.readClass(fn, cv::format("member_%d", member)));
+    return member;
+}
+
+int EnsembleDetector::readMember(const std::string &filename)
+{
+    FileStorage fs(filename, FileStorage::READ);
+    return readMember(fs.root());
+}
+
+std::vector<EnsembleDetector::Vote> EnsembleDetector::match(Mat source, float threshold, int min_votes,
+                                                            float nms_threshold, float vote_overlap,
+                                                            const Mat &mask) const
+{
+    return match(detector.prepare(source, mask), threshold, min_votes, nms_threshold, vote_overlap);
+}
+
+std::vector<EnsembleDetector::Vote> EnsembleDetector::match(const Ptr<const Detector::LinearMemoryPyramid> &prepared,
+                                                            float threshold, int min_votes,
+                                                            float nms_threshold, float vote_overlap) const
+{
+    CV_Assert(numMembers() > 0);
+    const int num_members = numMembers();
+
+    // One sweep over all members, results come back sorted by decreasing similarity
+    std::vector<Match> matches = detector.match(prepared, threshold, member_ids);
+
+    // Interned class index to member
+    std::vector<int> member_of(detector.numClasses(), -1);
+    for (int m = 0; m < num_members; ++m)
+        member_of[detector.classIndex(member_ids[m])] = m;
+
+    std::vector<std::vector<Match>> raw(num_members);
+    for (const Match &match : matches)
+        raw[member_of[match.class_index]].push_back(match);
+
+    // Suppress within each member first, so a member votes at most once per object
+    std::vector<BoxArray> members(num_members);
+    for (int m = 0; m < num_members; ++m)
+    {
+        for (int k : detector.suppressMatches(raw[m], nms_threshold))
+        {
+            const Match &match = raw[m][k];
+            const Template &templ = detector.getTemplates(member_ids[m], match.template_id)[0];
+            members[m].push_back(Rect(match.x, match.y, templ.width, templ.height), match.similarity);
+        }
     }
+
+    // Seeds are visited in decreasing score, each other member contributes its best unused overlap
+    std::vector<std::pair<int, int>> seeds;
+    std::vector<std::vector<uchar>> used(num_members);
+    for (int m = 0; m < num_members; ++m)
+    {
+        used[m].assign(members[m].size(), 0);
+        for (int i = 0; i < members[m].size(); ++i)
+            seeds.push_back(std::make_pair(m, i));
+    }
+    std::stable_sort(seeds.begin(), seeds.end(),
+                     [&members](const std::pair<int, int> &a, const std::pair<int, int> &b) {
+                         return members[a.first].score[a.second] > members[b.first].score[b.second];
+                     });
+
+    std::vector<Vote> votes;
+    std::vector<float> iou;
+    for (const std::pair<int, int> &seed : seeds)
+    {
+        const int m = seed.first, i = seed.second;
+        if (used[m][i])
+            continue;
+        used[m][i] = 1;
+
+        const BoxArray &a = members[m];
+        float w = a.score[i];
+        float sum_w = w, sum_score = a.score[i];
+        float x1 = a.x1[i] * w, y1 = a.y1[i] * w, x2 = a.x2[i] * w, y2 = a.y2[i] * w;
+        int count = 1;
+
+        for (int k = 0; k < num_members; ++k)
+        {
+            if (k == m)
+                continue;
+            const BoxArray &b = members[k];
+            iou.resize(b.size());
+            overlaps(a, i, b, iou.data());
+
+            int best = -1;
+            float best_iou = vote_overlap;
+            for (int j = 0; j < b.size(); ++j)
+            {
+                if (!used[k][j] && iou[j] > best_iou)
+                {
+                    best = j;
+                    best_iou = iou[j];
+                }
+            }
+            if (best < 0)
+                continue;
+
+            used[k][best] = 1;
+            w = b.score[best];
+            sum_w += w;
+            sum_score += b.score[best];
+            x1 += b.x1[best] * w;
+            y1 += b.y1[best] * w;
+            x2 += b.x2[best] * w;
+            y2 += b.y2[best] * w;
+            count++;
+        }
+
+        if (count >= min_votes)
+        {
+            Vote vote;
+            vote.box.x = cvRound(x1 / sum_w);
+            vote.box.y = cvRound(y1 / sum_w);
+            vote.box.width = cvRound(x2 / sum_w) - vote.box.x;
+            vote.box.height = cvRound(y2 / sum_w) - vote.box.y;
+            vote.similarity = sum_score / count;
+            vote.votes = count;
+            votes.push_back(vote);
+        }
+    }
+
+    // Merged boxes from different seeds may still overlap
+    std::vector<Rect> merged;
+    std::vector<float> merged_scores;
+    for (const Vote &vote : votes)
+    {
+        merged.push_back(vote.box);
+        merged_scores.push_back(vote.similarity);
+    }
+
+    std::vector<int> keep = suppressBoxes(merged, merged_scores, nms_threshold);
+    std::vector<Vote> result;
+    for (int k : keep)
+        result.push_back(votes[k]);
+    return result;
 }
 
 } // namespace line2Dup
@@ -5,6 +5,7 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <map>
+#include <type_traits>
 
 #include "mipp.h"  // for SIMD in different platforms
 
@@ -21,10 +22,10 @@ struct Feature
     void read(const cv::FileNode &fn);
     void write(cv::FileStorage &fs) const;
 
-    Feature() : x(0), y(0), label(0) {}
+    Feature() : x(0), y(0), label(0), theta(0) {}
     Feature(int x, int y, int label);
 };
-inline Feature::Feature(int _x, int _y, int _label) : x(_x), y(_y), label(_label) {}
+inline Feature::Feature(int _x, int _y, int _label) : x(_x), y(_y), label(_label), theta(0) {}
 
 struct Template
 {
@@ -35,6 +36,22 @@ struct Template
     int pyramid_level;
     std::vector<Feature> features;
 
+    /// Where a feature reads the linear memories of its pyramid level
+    struct LinearFeature
+    {
+        int x;          ///< Feature position, for bounds checks
+        int y;
+        int label;      ///< Linear memory set, linear_memories[label]
+        int grid_index; ///< Row of that set, (y mod T) * T + x mod T
+        int lm_x;       ///< Column within the row is lm_y * W + lm_x, with W = image width / T
+        int lm_y;
+    };
+    /// Features sorted by label, grid row and column so similarity streams through memory
+    std::vector<LinearFeature> linear_features;
+
+    /// Fill in linear_features for spreading factor T, after features last changed
+    void linearize(int T);
+
     void read(const cv::FileNode &fn);
     void write(cv::FileStorage &fs) const;
 };
@@ -44,16 +61,23 @@ class ColorGradientPyramid
 public:
     ColorGradientPyramid(const cv::Mat &src, const cv::Mat &mask,
                                              float weak_threshold, size_t num_features,
-                                             float strong_threshold);
+                                             float strong_threshold, bool compute_gradients = true,
+                                             bool blur_pyramid_levels = true);
 
     void quantize(cv::Mat &dst) const;
 
     bool extractTemplate(Template &templ) const;
 
-    void pyrDown();
+    void pyrDown(bool compute_gradients = true);
 
 public:
     void update();
+    /// Allocate gradient outputs for the current src, filled in later by update(row_begin, row_end)
+    void allocate();
+    /// Compute gradients of rows [row_begin, row_end) only, independent bands may run in parallel
+    void update(int row_begin, int row_end);
+    /// Whether the current level is blurred before differentiation
+    bool smoothSource() const;
     /// Candidate feature with a score
     struct Candidate
     {
@@ -75,11 +99,15 @@ public:
     int pyramid_level;
     cv::Mat angle;
     cv::Mat magnitude;
-    cv::Mat angle_ori;
+    // Sobel derivatives of the strongest channel, CV_16S
+    cv::Mat dx;
+    cv::Mat dy;
 
     float weak_threshold;
     size_t num_features;
     float strong_threshold;
+    /// Blur levels above 0 too, although pyrDown has already smoothed them
+    bool blur_pyramid_levels;
     static bool selectScatteredFeatures(const std::vector<Candidate> &candidates,
                                                                             std::vector<Feature> &features,
                                                                             size_t num_features, float distance);
@@ -97,12 +125,16 @@ public:
     float weak_threshold;
     size_t num_features;
     float strong_threshold;
+    /// See ColorGradientPyramid::blur_pyramid_levels, false saves a 7x7 blur per coarse level
+    bool blur_pyramid_levels;
     void read(const cv::FileNode &fn);
     void write(cv::FileStorage &fs) const;
 
-    cv::Ptr<ColorGradientPyramid> process(const cv::Mat src, const cv::Mat &mask = cv::Mat()) const
+    cv::Ptr<ColorGradientPyramid> process(const cv::Mat src, const cv::Mat &mask = cv::Mat(),
+                                          bool compute_gradients = true) const
     {
-        return cv::makePtr<ColorGradientPyramid>(src, mask, weak_threshold, num_features, strong_threshold);
+        return cv::makePtr<ColorGradientPyramid>(src, mask, weak_threshold, num_features, strong_threshold,
+                                                 compute_gradients, blur_pyramid_levels);
     }
 };
 
@@ -112,35 +144,60 @@ struct Match
     {
     }
 
-    Match(int x, int y, float similarity, const std::string &class_id, int template_id);
+    Match(int x, int y, float similarity, int class_index, int template_id);
 
     /// Sort matches with high similarity to the front
     bool operator<(const Match &rhs) const
     {
-        // Secondarily sort on template_id for the sake of duplicate removal
+        // Ties are fully ordered, template_id last so that matches equal under operator==
+        // end up adjacent and the one with the lowest template_id comes first
         if (similarity != rhs.similarity)
             return similarity > rhs.similarity;
-        else
-            return template_id < rhs.template_id;
+        if (class_index != rhs.class_index)
+            return class_index < rhs.class_index;
+        if (y != rhs.y)
+            return y < rhs.y;
+        if (x != rhs.x)
+            return x < rhs.x;
+        return template_id < rhs.template_id;
     }
 
     bool operator==(const Match &rhs) const
     {
-        return x == rhs.x && y == rhs.y && similarity == rhs.similarity && class_id == rhs.class_id;
+        return x == rhs.x && y == rhs.y && similarity == rhs.similarity && class_index == rhs.class_index;
     }
 
     int x;
     int y;
     float similarity;
-    std::string class_id;
+    int class_index; ///< Interned class id, see Detector::classId()
     int template_id;
 };
 
-inline Match::Match(int _x, int _y, float _similarity, const std::string &_class_id, int _template_id)
-        : x(_x), y(_y), similarity(_similarity), class_id(_class_id), template_id(_template_id)
+// Matches are plain data, safe to memcpy across threads or write out as raw bytes
+static_assert(std::is_trivially_copyable<Match>::value, "Match must stay trivially copyable");
+static_assert(sizeof(Match) == 20, "Match is expected to be 20 bytes");
+
+inline Match::Match(int _x, int _y, float _similarity, int _class_index, int _template_id)
+        : x(_x), y(_y), similarity(_similarity), class_index(_class_index), template_id(_template_id)
 {
 }
 
+/**
+ * \brief Continuous pose of a match, see Detector::refinePoses().
+ *
+ * Angle and scale are relative to the matched template, so the absolute pose is the
+ * template's own angle plus angle and its scale times scale.
+ */
+struct RefinedPose
+{
+    cv::Point2f center; ///< Image position of the centroid of the template's features
+    float angle;        ///< Degrees, counter-clockwise as for shapeInfo_producer
+    float scale;
+    float error;        ///< RMS distance of the fitted features to their edges, pixels
+    int inliers;        ///< Features that found an edge, the fit needs at least 4
+};
+
 class Detector
 {
 public:
@@ -152,10 +209,37 @@ public:
     Detector(std::vector<int> T);
     Detector(int num_features, std::vector<int> T, float weak_thresh = 30.0f, float strong_thresh = 60.0f);
 
+    typedef std::vector<cv::Mat> LinearMemories;
+
+    /**
+         * \brief Spread and linearized response maps of one source, for every pyramid level.
+         *
+         * Built by prepare() and never modified afterwards, so a single instance can be
+         * shared by any number of match() calls, thresholds and detectors using the same T.
+         */
+    struct LinearMemoryPyramid
+    {
+        // Indexed as [pyramid level][ColorGradient][quantized label]
+        std::vector<std::vector<LinearMemories>> levels;
+        // Size of the quantized source at each pyramid level
+        std::vector<cv::Size> sizes;
+        // T the linear memories were built with, must agree with the matching detector
+        std::vector<int> T_at_level;
+        // Quantization settings the source was processed with, must agree as well
+        float weak_threshold;
+        bool blur_pyramid_levels;
+        int pyramid_levels;
+    };
+
     std::vector<Match> match(cv::Mat sources, float threshold,
                                                      const std::vector<std::string> &class_ids = std::vector<std::string>(),
                                                      const cv::Mat masks = cv::Mat()) const;
 
+    cv::Ptr<const LinearMemoryPyramid> prepare(const cv::Mat source, const cv::Mat &mask = cv::Mat()) const;
+
+    std::vector<Match> match(const cv::Ptr<const LinearMemoryPyramid> &prepared, float threshold,
+                             const std::vector<std::string> &class_ids = std::vector<std::string>()) const;
+
     int addTemplate(const cv::Mat sources, const std::string &class_id,
                                     const cv::Mat &object_mask, int num_features = 0);
 
@@ -167,6 +251,85 @@ public:
 
     int pyramidLevels() const { return pyramid_levels; }
 
+    /**
+         * \brief Reject coarse positions as soon as they cannot reach the threshold anymore.
+         *
+         * The coarse pass then only tracks surviving positions instead of a full similarity
+         * map, which pays off at high thresholds. Matches are the same either way.
+         */
+    void setEarlyRejection(bool enable) { early_rejection = enable; }
+    bool earlyRejection() const { return early_rejection; }
+
+    /**
+         * \brief Size of the square search window, in positions of that level, used when
+         * refining matches at each pyramid level.
+         *
+         * One of 4, 8 or 16 per level. The coarsest level is searched exhaustively, its entry
+         * sizes the window setPoseGrid() searches for neighboring poses instead. 16 by default,
+         * 4 at the coarsest level.
+         */
+    void setRefinementWindows(const std::vector<int> &windows);
+    int refinementWindow(int pyramid_level) const { return refine_windows[pyramid_level]; }
+
+    /**
+         * \brief Only refine local maxima of the coarse similarity map, at most top_k per template.
+         *
+         * A coarse position is kept if no position within radius (in positions of the lowest
+         * level, a (2 * radius + 1) square) scores higher, ties go to the first in row-major
+         * order. radius = 0 skips that test, top_k = 0 keeps every local maximum; both 0, the
+         * default, refines every position above threshold. Either works on its own.
+         */
+    void setCoarseSuppression(int radius, int top_k = 0);
+    int coarseSuppressionRadius() const { return coarse_radius; }
+    int coarseTopK() const { return coarse_top_k; }
+
+    /**
+         * \brief Search the templates of class_id coarse-to-fine over rotation and scale.
+         *
+         * The templates must sample a num_angles x num_scales pose grid in the order of
+         * shapeInfo_producer::produce_infos(), template i at angle i % num_angles and scale
+         * i / num_angles. Only templates whose angle and scale indices are multiples of stride
+         * are matched over the whole image. Each of their candidates is then compared, at the
+         * coarsest level and around its position, with the templates less than stride grid
+         * steps away, and refined with the best of them. The neighbors are searched within
+         * refinementWindow() of the coarsest level. The sparse templates must still clear the
+         * threshold on their own, so stride should stay within their angular and scale
+         * tolerance. stride = 1 searches every template.
+         *
+         * \param angle_span angle_range[1] - angle_range[0] of the shapeInfo_producer the
+         *                   templates came from. Angles wrap around only if it is 360 or more.
+         */
+    void setPoseGrid(const std::string &class_id, int num_angles, int num_scales, int stride,
+                     float angle_span = 0.f);
+
+    /**
+         * \brief Fit sub-pixel position, rotation and scale of each match to the edges of source.
+         *
+         * source is the image the matches were found in. Every feature of the matched
+         * template is paired with the strongest edge within search_radius pixels along its
+         * gradient direction, of similar orientation, then a similarity transform is fitted
+         * to the point-to-edge distances by least squares. Pairing and fitting alternate for
+         * at most iterations rounds. Lets templates be trained at a coarser angle_step.
+         */
+    std::vector<RefinedPose> refinePoses(const cv::Mat &source, const std::vector<Match> &matches,
+                                         int iterations = 8, float search_radius = 3.f) const;
+
+    /**
+         * \brief Greedy non-maximum suppression of matches by the overlap of their templates.
+         *
+         * Matches are visited by decreasing similarity and one survives if it overlaps no
+         * survivor by more than nms_threshold, as intersection over union. Survivors are
+         * binned on a uniform grid by center, with cells as large as the largest box, so each
+         * match is only compared to the survivors in the 3 x 3 cells around it.
+         *
+         * \param angles Empty to compare the axis-aligned template boxes. Otherwise the
+         *               rotation of each match's template in degrees, counter-clockwise as for
+         *               shapeInfo_producer, and boxes follow the features along rotated axes.
+         * \return Indices into matches of the survivors, by decreasing similarity.
+         */
+    std::vector<int> suppressMatches(const std::vector<Match> &matches, float nms_threshold,
+                                     const std::vector<float> &angles = std::vector<float>()) const;
+
     const std::vector<Template> &getTemplates(const std::string &class_id, int template_id) const;
 
     int numTemplates() const;
@@ -175,34 +338,123 @@ public:
 
     std::vector<std::string> classIds() const;
 
+    /// Class id of an interned class index, as stored in Match::class_index
+    const std::string &classId(int class_index) const { return class_names[class_index]; }
+    /// Interned index of a class id, -1 if the detector has no such class
+    int classIndex(const std::string &class_id) const;
+
     void read(const cv::FileNode &fn);
     void write(cv::FileStorage &fs) const;
 
     std::string readClass(const cv::FileNode &fn, const std::string &class_id_override = "");
-    void writeClass(const std::string &class_id, cv::FileStorage &fs) const;
+    /**
+         * \brief Write the templates of class_id.
+         *
+         * With compact, templates made by addTemplate_rotate() are stored as runs of
+         * (base template, center, first angle, angle step) instead of their features, and
+         * readClass() regenerates them in parallel. The result is identical to the full format.
+         */
+    void writeClass(const std::string &class_id, cv::FileStorage &fs, bool compact = false) const;
 
     void readClasses(const std::vector<std::string> &class_ids,
                                      const std::string &format = "templates_%s.yml.gz");
-    void writeClasses(const std::string &format = "templates_%s.yml.gz") const;
+    void writeClasses(const std::string &format = "templates_%s.yml.gz", bool compact = false) const;
 
 protected:
     cv::Ptr<ColorGradient> modality;
     int pyramid_levels;
     std::vector<int> T_at_level;
+    bool early_rejection;
+    std::vector<int> refine_windows;
+    int coarse_radius;
+    int coarse_top_k;
+
+    /// Layout of a class' templates over rotation and scale, see setPoseGrid()
+    struct PoseGrid
+    {
+        int num_angles;
+        int num_scales;
+        int stride;
+        bool wrap_angles;
+    };
+    std::map<std::string, PoseGrid> pose_grids;
 
     typedef std::vector<Template> TemplatePyramid;
     typedef std::map<std::string, std::vector<TemplatePyramid>> TemplatesMap;
     TemplatesMap class_templates;
 
-    typedef std::vector<cv::Mat> LinearMemories;
-    // Indexed as [pyramid level][ColorGradient][quantized label]
-    typedef std::vector<std::vector<LinearMemories>> LinearMemoryPyramid;
+    /// Where a template came from, base < 0 unless addTemplate_rotate() derived it from base
+    struct TemplateOrigin
+    {
+        int base;
+        float theta;
+        cv::Point2f center;
+    };
+    /// Origin of every template of a class, same indexing as class_templates
+    std::map<std::string, std::vector<TemplateOrigin>> class_origins;
+
+    TemplatePyramid rotatePyramid(const TemplatePyramid &base, float theta, cv::Point2f center) const;
+
+    // Class ids interned in insertion order, Match::class_index refers to this table
+    std::vector<std::string> class_names;
+    std::map<std::string, int> class_indices;
+    int internClass(const std::string &class_id);
+
+    /// Every thread appends its matches to its own arena, arenas[thread]
+    typedef std::vector<std::vector<Match>> MatchArenas;
 
     void matchClass(const LinearMemoryPyramid &lm_pyramid,
-                                    const std::vector<cv::Size> &sizes,
-                                    float threshold, std::vector<Match> &matches,
-                                    const std::string &class_id,
-                                    const std::vector<TemplatePyramid> &template_pyramids) const;
+                                    float threshold, MatchArenas &arenas,
+                                    const std::vector<TemplatesMap::const_iterator> &classes) const;
+
+    /// Replace a coarse candidate by the best pose of its grid neighborhood, at the coarsest level
+    void searchPoses(const LinearMemoryPyramid &lm_pyramid, const std::vector<TemplatePyramid> &pyramids,
+                     const PoseGrid &grid, Match &match, cv::Mat &similarities) const;
+};
+
+/**
+ * \brief N template sets sharing one T pyramid, merged by voting.
+ *
+ * Every member is kept as its own class inside a single Detector, so the response maps
+ * are built once and all members are matched in one parallel sweep. Each member's
+ * matches are suppressed on their own, then boxes from different members vote.
+ */
+class EnsembleDetector
+{
+public:
+    struct Vote
+    {
+        cv::Rect box;     // score weighted mean of the voting boxes
+        float similarity; // mean similarity of the voting boxes
+        int votes;        // number of distinct members that agreed
+    };
+
+    EnsembleDetector() {}
+    EnsembleDetector(int num_features, std::vector<int> T, float weak_thresh = 30.0f, float strong_thresh = 60.0f);
+
+    /// Add a class written by Detector::writeClass as a new member, returns its index.
+    int readMember(const cv::FileNode &fn);
+    int readMember(const std::string &filename);
+
+    int numMembers() const { return static_cast<int>(member_ids.size()); }
+
+    const Detector &getDetector() const { return detector; }
+
+    cv::Ptr<const Detector::LinearMemoryPyramid> prepare(const cv::Mat source, const cv::Mat &mask = cv::Mat()) const
+    {
+        return detector.prepare(source, mask);
+    }
+
+    std::vector<Vote> match(cv::Mat source, float threshold, int min_votes = 2,
+                            float nms_threshold = 0.3f, float vote_overlap = 0.3f,
+                            const cv::Mat &mask = cv::Mat()) const;
+
+    std::vector<Vote> match(const cv::Ptr<const Detector::LinearMemoryPyramid> &prepared, float threshold,
+                            int min_votes = 2, float nms_threshold = 0.3f, float vote_overlap = 0.3f) const;
+
+protected:
+    Detector detector;
+    std::vector<std::string> member_ids;
 };
 
 } // namespace line2Dup
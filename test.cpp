@@ -26,103 +26,6 @@ private:
     typedef std::chrono::duration<double, std::ratio<1> > second_;
     std::chrono::time_point<clock_> beg_;
 };
-// NMS, got from cv::dnn so we don't need opencv contrib
-// just collapse it
-namespace  cv_dnn {
-namespace
-{
-
-template <typename T>
-static inline bool SortScorePairDescend(const std::pair<float, T>& pair1,
-                          const std::pair<float, T>& pair2)
-{
-    return pair1.first > pair2.first;
-}
-
-} // namespace
-
-inline void GetMaxScoreIndex(const std::vector<float>& scores, const float threshold, const int top_k,
-                      std::vector<std::pair<float, int> >& score_index_vec)
-{
-    for (size_t i = 0; i < scores.size(); ++i)
-    {
-        if (scores[i] > threshold)
-        {
-            score_index_vec.push_back(std::make_pair(scores[i], i));
-        }
-    }
-    std::stable_sort(score_index_vec.begin(), score_index_vec.end(),
-                     SortScorePairDescend<int>);
-    if (top_k > 0 && top_k < (int)score_index_vec.size())
-    {
-        score_index_vec.resize(top_k);
-    }
-}
-
-template <typename BoxType>
-inline void NMSFast_(const std::vector<BoxType>& bboxes,
-      const std::vector<float>& scores, const float score_threshold,
-      const float nms_threshold, const float eta, const int top_k,
-      std::vector<int>& indices, float (*computeOverlap)(const BoxType&, const BoxType&))
-{
-    CV_Assert(bboxes.size() == scores.size());
-    std::vector<std::pair<float, int> > score_index_vec;
-    GetMaxScoreIndex(scores, score_threshold, top_k, score_index_vec);
-
-    // Do nms.
-    float adaptive_threshold = nms_threshold;
-    indices.clear();
-    for (size_t i = 0; i < score_index_vec.size(); ++i) {
-        const int idx = score_index_vec[i].second;
-        bool keep = true;
-        for (int k = 0; k < (int)indices.size() && keep; ++k) {
-            const int kept_idx = indices[k];
-            float overlap = computeOverlap(bboxes[idx], bboxes[kept_idx]);
-            keep = overlap <= adaptive_threshold;
-        }
-        if (keep)
-            indices.push_back(idx);
-        if (keep && eta < 1 && adaptive_threshold > 0.5) {
-          adaptive_threshold *= eta;
-        }
-    }
-}
-
-"""
-我爸妈让我哥哥七月底的时候去重庆家里的一个公司实习, 他走的时候爸妈给他买了新手机,  
-"""
-
-
-// copied from opencv 3.4, not exist in 3.0
-template<typename _Tp> static inline
-double jaccardDistance__(const Rect_<_Tp>& a, const Rect_<_Tp>& b) {
-    _Tp Aa = a.area();
-    _Tp Ab = b.area();
-
-    if ((Aa + Ab) <= std::numeric_limits<_Tp>::epsilon()) {
-        // jaccard_index = 1 -> distance = 0
-        return 0.0;
-    }
-
-    double Aab = (a & b).area();
-    // distance = 1 - jaccard_index
-    return 1.0 - Aab / (Aa + Ab - Aab);
-}
-
-template <typename T>
-static inline float rectOverlap(const T& a, const T& b)
-{
-    return 1.f - static_cast<float>(jaccardDistance__(a, b));
-}
-
-void NMSBoxes(const std::vector<Rect>& bboxes, const std::vector<float>& scores,
-                          const float score_threshold, const float nms_threshold,
-                          std::vector<int>& indices, const float eta=1, const int top_k=0)
-{
-    NMSFast_(bboxes, scores, score_threshold, nms_threshold, eta, top_k, indices, rectOverlap);
-}
-
-}
 
 void scale_test(string mode = "test"){
     int num_feature = 150;
@@ -292,7 +195,8 @@ void angle_test(string mode = "test", bool use_rot = true){
                 infos_have_templ.push_back(info);
             }
         }
-        detector.writeClasses(prefix+"case1/%s_templ.yaml");
+        // rotations are stored as angles of the first template, not as features
+        detector.writeClasses(prefix+"case1/%s_templ.yaml", true);
         shapes.save_infos(infos_have_templ, prefix + "case1/test_info.yaml");
         std::cout << "train end" << std::endl << std::endl;
     }else if(mode=="test"){
@@ -436,28 +340,12 @@ void noise_test(string mode = "test"){
         size_t top5 = 500;
         if(top5>matches.size()) top5=matches.size();
 
-        vector<Rect> boxes;
-        vector<float> scores;
-        vector<int> idxs;
-        for(auto match: matches){
-            Rect box;
-            box.x = match.x;
-            box.y = match.y;
-
-            auto templ = detector.getTemplates("test",
-                                               match.template_id);
-
-            box.width = templ[0].width;
-            box.height = templ[0].height;
-            boxes.push_back(box);
-            scores.push_back(match.similarity);
-        }
-        cv_dnn::NMSBoxes(boxes, scores, 0, 0.5f, idxs);
+        vector<int> idxs = detector.suppressMatches(matches, 0.5f);
 
         for(auto idx: idxs){
             auto match = matches[idx];
-            auto templ = detector.getTemplates("test",
-                                               match.template_id);
+            const auto &templ = detector.getTemplates("test",
+                                                      match.template_id);
 
             int x =  templ[0].width + match.x;
             int y = templ[0].height + match.y;
@@ -487,6 +375,58 @@ void noise_test(string mode = "test"){
     }
 }
 
+void refine_test(){
+    line2Dup::Detector detector(64, {4, 8});
+
+    // an L on a plain background, nothing symmetric for the fit to slide along
+    Mat img(320, 320, CV_8UC1, Scalar::all(40));
+    rectangle(img, Rect(120, 100, 30, 100), Scalar::all(200), -1);
+    rectangle(img, Rect(120, 170, 80, 30), Scalar::all(200), -1);
+    Mat mask = Mat(img.size(), CV_8UC1, {255});
+
+    string class_id = "refine";
+    int templ_id = detector.addTemplate(img, class_id, mask);
+    assert(templ_id == 0);
+    std::vector<std::string> ids;
+    ids.push_back(class_id);
+
+    // on the training image the pose is the template's own
+    auto matches = detector.match(img, 90, ids);
+    assert(!matches.empty());
+    auto poses = detector.refinePoses(img, {matches[0]});
+    Point2f center = poses[0].center;
+    assert(std::abs(poses[0].angle) < 0.05f && std::abs(poses[0].scale - 1) < 0.002f);
+
+    // sub-degree rotations and sub-pixel shifts, below what template matching resolves
+    const float cases[][3] = {{0.f, 0.3f, 0.f}, {0.4f, 0.3f, -0.2f}, {-0.7f, -0.6f, 0.45f}, {0.9f, 0.5f, 0.5f}};
+    for(auto& c: cases){
+        Mat rot_mat = getRotationMatrix2D(Point2f(160, 150), c[0], 1);
+        rot_mat.at<double>(0, 2) += c[1];
+        rot_mat.at<double>(1, 2) += c[2];
+        Mat test_img;
+        warpAffine(img, test_img, rot_mat, img.size());
+
+        matches = detector.match(test_img, 90, ids);
+        assert(!matches.empty());
+        poses = detector.refinePoses(test_img, {matches[0]});
+        auto& pose = poses[0];
+
+        // where the training pose's center moved to
+        Point2f expected(float(rot_mat.at<double>(0, 0)*center.x + rot_mat.at<double>(0, 1)*center.y + rot_mat.at<double>(0, 2)),
+                         float(rot_mat.at<double>(1, 0)*center.x + rot_mat.at<double>(1, 1)*center.y + rot_mat.at<double>(1, 2)));
+        Point2f offset = pose.center - expected;
+
+        std::cout << "angle: " << pose.angle << " / " << c[0]
+                  << "  center error: " << offset.x << ", " << offset.y
+                  << "  scale: " << pose.scale << "  rms: " << pose.error << std::endl;
+
+        assert(std::abs(pose.angle - c[0]) < 0.1f);
+        assert(std::abs(offset.x) < 0.1f && std::abs(offset.y) < 0.1f);
+        assert(std::abs(pose.scale - 1) < 0.002f);
+    }
+    std::cout << "refine test end" << std::endl << std::endl;
+}
+
 void MIPP_test(){
     std::cout << "MIPP tests" << std::endl;
     std::cout << "----------" << std::endl << std::endl;
@@ -514,5 +454,6 @@ int main(){
     // scale_test("test");
     // angle_test("test", true); // test or train
     noise_test("test");
+    // refine_test();
     return 0;
 }